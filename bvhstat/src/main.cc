@@ -0,0 +1,73 @@
+#include<c3d.h>
+#include<chrono>
+#include<cstdio>
+#include<cstring>
+#include<fstream>
+#include<limits>
+#include<stdexcept>
+#include<string>
+int main(int argc,char** argv){
+    using namespace c3d;
+    const auto usage=[&]{
+        std::fprintf(stderr,"usage: %s <spheres> [--leaf-size n] [--search-radius n] [--morton-bits 30|63] [--export prefix]\n"
+                            "  spheres: text file with one sphere per line as x y z radius\n",argv[0]);
+        return 1;
+    };
+    if(argc<2)
+        return usage();
+    BvhOptions options;
+    std::string prefix;
+    for(int i=2;i<argc;i+=2){
+        const bool known=!std::strcmp(argv[i],"--leaf-size")||!std::strcmp(argv[i],"--search-radius")||!std::strcmp(argv[i],"--morton-bits")||!std::strcmp(argv[i],"--export");
+        if(!known)
+            return std::fprintf(stderr,"unknown option %s\n",argv[i]),usage();
+        if(i+1==argc)
+            return std::fprintf(stderr,"option %s needs a value\n",argv[i]),usage();
+        try{
+            if(!std::strcmp(argv[i],"--leaf-size")){
+                const long long size=std::stoll(argv[i+1]);
+                if(size<=0||size>std::numeric_limits<std::uint32_t>::max())
+                    throw std::out_of_range(argv[i]);
+                options.leafSize=static_cast<std::uint32_t>(size);
+            }
+            else if(!std::strcmp(argv[i],"--search-radius"))
+                options.searchRadius=static_cast<std::uint32_t>(std::stoul(argv[i+1]));
+            else if(!std::strcmp(argv[i],"--morton-bits"))
+                options.mortonBits=static_cast<std::uint32_t>(std::stoul(argv[i+1]));
+            else
+                prefix=argv[i+1];
+        }catch(const std::exception&){
+            return std::fprintf(stderr,"invalid value %s of option %s\n",argv[i+1],argv[i]),usage();
+        }
+    }
+    std::ifstream in(argv[1]);
+    if(!in)
+        return std::perror(argv[1]),1;
+    std::vector<std::shared_ptr<const Hittable>> objects;
+    for(double x,y,z,radius;in>>x>>y>>z>>radius;){
+        auto sphere=std::make_shared<Sphere>();
+        sphere->center={x,y,z},sphere->radius=radius;
+        objects.push_back(std::move(sphere));
+    }
+    std::printf("%zu objects\n",objects.size());
+    for(const auto& [builder,name]:{std::pair{BvhBuilder::median,"median"},{BvhBuilder::lbvh,"lbvh"},{BvhBuilder::ploc,"ploc"}}){
+        options.builder=builder;
+        const auto begin=std::chrono::steady_clock::now();
+        const BvhTree tree(objects,options);
+        const double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        const BvhStats stats=tree.stats();
+        std::printf("\n%s: built in %.3f s\n  SAH cost %.4g, sibling overlap %.4g\n  %zu interior nodes, %zu leaves, %zu bytes\n  depth:",
+                    name,seconds,stats.sah,stats.overlap,stats.interiors,stats.leaves,stats.bytes);
+        for(std::size_t i=0;i<stats.depths.size();++i)
+            if(stats.depths[i])
+                std::printf(" %zu:%zu",i,stats.depths[i]);
+        std::printf("\n  leaf size:");
+        for(std::size_t i=0;i<stats.leafSizes.size();++i)
+            if(stats.leafSizes[i])
+                std::printf(" %zu:%zu",i,stats.leafSizes[i]);
+        std::printf("\n");
+        if(!prefix.empty()&&!tree.exportLeaves(prefix+"-"+name+".obj"))
+            return std::fprintf(stderr,"cannot write %s-%s.obj\n",prefix.c_str(),name),1;
+    }
+    return 0;
+}
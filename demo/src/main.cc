@@ -1,5 +1,44 @@
 #include<c3d.h>
-int main(){
-    //TODO:sync with dev-java
+#include<cstdio>
+#include<string>
+int main(int argc,char** argv){
+    using namespace c3d;
+    const std::string output=argc>1?argv[1]:"c3d-demo.ppm";
+    const auto diffuse=std::make_shared<Diffuse>();
+    const auto mirror=std::make_shared<Mirror>();
+    std::vector<std::shared_ptr<const Hittable>> objects;
+    const auto add=[&](const Vector& center,const double& radius,std::shared_ptr<Material> material,std::shared_ptr<Light> light=nullptr){
+        auto sphere=std::make_shared<Sphere>();
+        sphere->center=center,sphere->radius=radius,sphere->material=std::move(material),sphere->light=std::move(light);
+        objects.push_back(std::move(sphere));
+    };
+    add({0,-1000,0},1000,diffuse);
+    add({-2.2,1,0},1,diffuse);
+    add({0,1,0.5},1,mirror);
+    add({2.2,1,0},1,diffuse);
+    add({-3,5,-2},0.8,nullptr,std::make_shared<Light>(Light{{1,0.9,0.8},20}));
+    add({3,4,-3},0.4,nullptr,std::make_shared<Light>(Light{{0.6,0.7,1},40}));
+    const BvhTree scene(objects);
+    const Camera camera{{0,2,-8},{0,-0.15,1},{0,1,0},PI/3,640,360};
+    Framebuffer framebuffer(camera.width,camera.height);
+    PathTracer integrator;
+    integrator.background={0.05,0.06,0.08};
+    integrator.lights=std::make_shared<LightTree>(Emitters(objects));
+    integrator.spread=camera.fov/static_cast<double>(camera.height);
+    RenderOptions options;
+    options.passes=16;
+    Renderer(options).render(scene,camera,integrator,framebuffer);
+    MemoryUsage usage;
+    scene.memory(usage);
+    framebuffer.memory(usage);
+    std::printf("memory: nodes %zu, primitives %zu, materials %zu, buffers %zu, overhead %zu, total %zu bytes\n",
+                usage.nodes,usage.primitives,usage.materials,usage.buffers,usage.overhead,usage.total());
+    const std::vector<std::uint8_t> pixels=encodeSrgb8(framebuffer);
+    std::FILE* file=std::fopen(output.c_str(),"wb");
+    if(!file)
+        return std::perror(output.c_str()),1;
+    std::fprintf(file,"P6\n%zu %zu\n255\n",framebuffer.width,framebuffer.height);
+    std::fwrite(pixels.data(),1,pixels.size(),file);
+    std::fclose(file);
     return 0;
 }
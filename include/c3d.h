@@ -10,10 +10,61 @@
 #define GOXJANSKLOON_C3D_H_
 
 #include<algorithm>
+#include<array>
+#include<atomic>
+#include<barrier>
+#include<bit>
+#include<chrono>
+#include<cmath>
+#include<condition_variable>
+#include<cstdint>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<deque>
+#include<exception>
+#include<filesystem>
+#include<fstream>
+#include<future>
+#include<iomanip>
+#include<latch>
 #include<limits>
+#include<list>
 #include<memory>
+#include<mutex>
+#include<new>
+#include<numeric>
+#include<optional>
 #include<random>
 #include<ranges>
+#include<stdexcept>
+#include<string>
+#include<thread>
+#include<tuple>
+#include<unordered_map>
+#include<unordered_set>
+#include<utility>
+#include<vector>
+#if defined(__unix__)||defined(__APPLE__)
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#endif
+#ifdef __linux__
+#include<sched.h>
+#endif
+#if (defined(__GNUC__)||defined(__clang__))&&(defined(__x86_64__)||defined(__i386__))
+#define C3D_DISPATCH
+#endif
+///Placed before a loop whose iterations only access distinct elements of the arrays they touch, so that it vectorizes without alias checks.
+#if defined(__clang__)
+#define C3D_INDEPENDENT _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define C3D_INDEPENDENT _Pragma("GCC ivdep")
+#else
+#define C3D_INDEPENDENT
+#endif
 
 namespace c3d{
 
@@ -23,6 +74,9 @@ constexpr double INF=std::numeric_limits<double>::infinity();
 ///Pi in double, generated by the inverse cosine value of -1.
 constexpr double PI=std::acos(-1);
 
+///Minimum distance of a valid hit, rejecting self-intersections at the origin of a ray.
+constexpr double EPSILON=1e-9;
+
 ///Interval [min,max] of doubles.
 class Interval{
 public:
@@ -66,11 +120,13 @@ public:
     [[nodiscard]] double length()const{return max-min;}
 
     ///A universe interval, [-infinity,infinity]
-    static constexpr Interval universe{-INF,INF};
+    static const Interval universe;
 
     ///An empty interval, [infinity,-infinity]
-    static constexpr Interval empty{INF,-INF};
+    static const Interval empty;
 };
+inline constexpr Interval Interval::universe{-INF,INF};
+inline constexpr Interval Interval::empty{INF,-INF};
 
 ///@returns Union of the 2 Intervals.
 inline Interval unite(const Interval& a,const Interval& b){return{std::min(a.min,b.min),std::max(a.max,b.max)};}
@@ -81,6 +137,8 @@ public:
 
     double x,y,z;
 
+    ///@return The component on axis i, 0 for x, 1 for y and 2 for z.
+    [[nodiscard]] const double& operator[](const std::size_t& i)const{return i==0?x:i==1?y:z;}
 
     Vector& rotate(const Vector& origin,const Vector& axis,const double& a);
     Vector& rotate(const Vector& axis,const double& a);
@@ -97,6 +155,8 @@ inline Vector operator&(const Vector& a,const Vector& b){return{a.y*b.z-a.z*b.y,
 inline Vector operator/(const Vector& v,const double& a){return{v.x/a,v.y/a,v.z/a};}
 inline Vector& operator/=(Vector& v,const double& a){return v.x/=a,v.y/=a,v.z/=a,v;}
 inline Vector operator-(const Vector& v){return{-v.x,-v.y,-v.z};}
+inline Vector hadamard(const Vector& a,const Vector& b){return{a.x*b.x,a.y*b.y,a.z*b.z};}
+inline double luminance(const Color& c){return c.x*0.2126+c.y*0.7152+c.z*0.0722;}
 inline double normSq(const Vector& v){return v.x*v.x+v.y*v.y+v.z*v.z;}
 inline double norm(const Vector& v){return sqrt(normSq(v));}
 inline Vector unit(const Vector& v){return v/norm(v);}
@@ -106,39 +166,299 @@ inline bool operator==(const Vector& a,const Vector& b){return a.x==b.x&&a.y==b.
 inline Vector& Vector::rotate(const Vector& origin,const Vector&axis,const double&a){return *this-=origin,*this=rotate(axis,a)+origin;}
 inline Vector& Vector::rotate(const Vector& axis,const double&a){const double c=std::cos(a);return *this=*this*c+axis*(1-c)*(*this*axis)+(*this&axis)*std::sin(a);}
 inline Vector& Vector::unitize(){return *this/=norm(*this);}
+
+///@return Mirror reflection of v about the plane with unit normal n.
+inline Vector reflect(const Vector& v,const Vector& n){return v-n*(v*n*2);}
 template<typename G>Vector RandUnitVec3(G& generator){
-    static std::uniform_real_distribution<> d(-1,1);
-    const double b=d(generator),r=sqrt(b*(b-1))*2,l=2*PI*d(generator);
+    std::uniform_real_distribution<> d(0,1);
+    const double b=d(generator),r=sqrt(b*(1-b))*2,l=2*PI*d(generator);
     return{std::cos(l)*r,std::sin(l)*r,1-2*b};
 }
 template<typename G>Vector RandVec3OnUnitHemisphere(G& generator,const Vector& n){
-    static const std::uniform_real_distribution<> d(-1,1);
-    const double b=d(generator),r=sqrt(b*(b-1))*2,l=2*PI*d(generator);
-    const Vector v{std::cos(l)*r,std::sin(l)*r,1-2*b};
+    const Vector v=RandUnitVec3(generator);
     return v*n>0?v:-v;
 }
+
+///Build unit vectors t and b so that {t,b,n} is an orthonormal basis around unit vector n.
+inline void orthonormalBasis(const Vector& n,Vector& t,Vector& b){
+    const double s=std::copysign(1.,n.z),a=-1/(s+n.z),c=n.x*n.y*a;
+    t={1+s*n.x*n.x*a,s*c,-s*n.x},b={c,s+n.y*n.y*a,-n.y};
+}
+
+/**
+ * Branch-free square root of x in [0,DBL_MAX] by four Newton steps on the inverse square root, relative error below 1e-15.
+ * Unlike std::sqrt it may not set errno, so loops calling it vectorize.
+ */
+inline double vectorSqrt(const double& x){
+    double y=std::bit_cast<double>(0x5fe6eb50c7b537a9-(std::bit_cast<std::uint64_t>(x)>>1));
+    for(int i=0;i<4;++i)
+        y*=1.5-0.5*x*y*y;
+    return x*y;
+}
+
+/**
+ * Branch-free sine s and cosine c of 2*pi*v for v in [0,1), absolute error below 1e-13.
+ * v is reduced to a quarter turn r around the nearest multiple of pi/2, where Taylor polynomials of degree 13 and 14 are accurate,
+ * and the quadrant swaps and negates them arithmetically, so loops calling it vectorize.
+ */
+inline void vectorSinCos2Pi(const double& v,double& s,double& c){
+    const std::int32_t q=static_cast<std::int32_t>(v*4+0.5),k=q&3,m=(k+1)>>1;
+    const double r=(v*4-q)*(PI/2),r2=r*r,odd=k&1,sine=1-2*(k>>1),cosine=1-2*(m&1);
+    const double ps=r*(1+r2*(-1./6+r2*(1./120+r2*(-1./5040+r2*(1./362880+r2*(-1./39916800+r2*(1./6227020800)))))));
+    const double pc=1+r2*(-1./2+r2*(1./24+r2*(-1./720+r2*(1./40320+r2*(-1./3628800+r2*(1./479001600+r2*(-1./87178291200)))))));
+    s=(ps+odd*(pc-ps))*sine,c=(pc+odd*(ps-pc))*cosine;
+}
+
+///Structure of arrays view of vectors, with their components in three separate arrays so that batch loops vectorize.
+struct Vectors{
+    double *x,*y,*z;
+    [[nodiscard]] Vector operator[](const std::size_t& i)const{return{x[i],y[i],z[i]};}
+    void set(const std::size_t& i,const Vector& v)const{x[i]=v.x,y[i]=v.y,z[i]=v.z;}
+    [[nodiscard]] Vectors operator+(const std::size_t& offset)const{return{x+offset,y+offset,z+offset};}
+};
+
+///Growable storage behind a Vectors view.
+class VectorArray{
+public:
+    std::vector<double> x,y,z;
+    void reserve(const std::size_t& size){x.reserve(size),y.reserve(size),z.reserve(size);}
+    void resize(const std::size_t& size){x.resize(size),y.resize(size),z.resize(size);}
+    [[nodiscard]] Vectors data(){return{x.data(),y.data(),z.data()};}
+};
+
+///@return Random unit vector on the hemisphere around unit vector n with density cos/pi.
+template<typename G>Vector RandCosineVec3OnUnitHemisphere(G& generator,const Vector& n){
+    std::uniform_real_distribution<> d(0,1);
+    const double u=d(generator),l=2*PI*d(generator),r=std::sqrt(u);
+    Vector t,b;
+    orthonormalBasis(n,t,b);
+    return t*(std::cos(l)*r)+b*(std::sin(l)*r)+n*std::sqrt(1-u);
+}
+
+///Random number generator used by rendering.
+using Generator=std::mt19937_64;
+
+/**
+ * Generator of the calling thread.
+ * Material::generate takes no generator, so randomized materials draw from this one, which Renderer seeds per tile.
+ */
+inline Generator& threadGenerator(){
+    thread_local Generator generator;
+    return generator;
+}
+
+///@return Whether the calling thread must not allocate from the heap, checked by operator new if C3D_CHECK_ALLOCATIONS is defined.
+inline bool& allocationForbidden(){
+    thread_local bool forbidden=false;
+    return forbidden;
+}
+
+/**
+ * Scope setting allocationForbidden() of the calling thread, restoring it on exit.
+ * Renderer forbids allocation only around tiles that already have samples, rendered by a thread that has warmed up on a tile as large,
+ * so the first pass is never checked and neither is a whole render with RenderOptions::passes at its default of 1.
+ */
+class AllocationScope{
+    bool previous;
+public:
+    explicit AllocationScope(const bool& forbidden):previous(std::exchange(allocationForbidden(),forbidden)){}
+    ~AllocationScope(){allocationForbidden()=previous;}
+    AllocationScope(const AllocationScope&)=delete;
+    AllocationScope& operator=(const AllocationScope&)=delete;
+};
+
+///Instruction set levels hot kernels are compiled for, from the baseline of the build to AVX-512.
+enum class Isa{
+    generic,
+    ///SSE4.2 and POPCNT.
+    sse42,
+    ///AVX2, FMA and BMI2.
+    avx2,
+    ///AVX-512 F, VL, BW and DQ on top of avx2.
+    avx512
+};
+
+/**
+ * Find the best Isa of the CPU by cpuid, once.
+ * The environment variable C3D_ISA, one of generic, sse4.2, avx2 and avx512, can lower it, for example to compare the levels.
+ * Any other value is reported on stderr and treated as generic.
+ */
+inline Isa cpuIsa(){
+    static const Isa isa=[]{
+        Isa ret=Isa::generic;
+#ifdef C3D_DISPATCH
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f")&&__builtin_cpu_supports("avx512vl")&&__builtin_cpu_supports("avx512bw")&&__builtin_cpu_supports("avx512dq")&&
+           __builtin_cpu_supports("avx2")&&__builtin_cpu_supports("fma")&&__builtin_cpu_supports("bmi2"))
+            ret=Isa::avx512;
+        else if(__builtin_cpu_supports("avx2")&&__builtin_cpu_supports("fma")&&__builtin_cpu_supports("bmi2"))
+            ret=Isa::avx2;
+        else if(__builtin_cpu_supports("sse4.2")&&__builtin_cpu_supports("popcnt"))
+            ret=Isa::sse42;
+#endif
+        if(const char* name=std::getenv("C3D_ISA")){
+            const std::string level=name;
+            Isa limit=Isa::generic;
+            if(level=="sse4.2")
+                limit=Isa::sse42;
+            else if(level=="avx2")
+                limit=Isa::avx2;
+            else if(level=="avx512")
+                limit=Isa::avx512;
+            else if(level!="generic")
+                std::fprintf(stderr,"c3d: unknown C3D_ISA %s, using generic\n",name);
+            ret=std::min(ret,limit);
+        }
+        return ret;
+    }();
+    return isa;
+}
+
+#ifdef C3D_DISPATCH
+//Every call in f, unless virtual or through a pointer, is inlined into these, so that all of it is compiled for the target.
+template<typename F>[[gnu::flatten]] decltype(auto) runGeneric(const F& f){return f();}
+template<typename F>[[gnu::flatten,gnu::target("sse4.2,popcnt")]] decltype(auto) runSse42(const F& f){return f();}
+template<typename F>[[gnu::flatten,gnu::target("avx2,fma,bmi,bmi2")]] decltype(auto) runAvx2(const F& f){return f();}
+template<typename F>[[gnu::flatten,gnu::target("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma,bmi,bmi2")]] decltype(auto) runAvx512(const F& f){return f();}
+#endif
+
+/**
+ * Run f() compiled for cpuIsa(), for hot kernels of a binary built for a baseline CPU.
+ * f and everything it calls directly are compiled once per Isa, so f should be a short loop rather than a whole pass.
+ * Virtual calls stay compiled for the baseline, so BvhTree calls Sphere::hit directly; other primitives are intersected at the baseline.
+ * Results may differ in the last bits between levels, where FMA contracts multiplications and additions.
+ */
+template<typename F>decltype(auto) dispatch(const F& f){
+#ifdef C3D_DISPATCH
+    switch(cpuIsa()){
+    case Isa::avx512:
+        return runAvx512(f);
+    case Isa::avx2:
+        return runAvx2(f);
+    case Isa::sse42:
+        return runSse42(f);
+    default:
+        return runGeneric(f);
+    }
+#else
+    return f();
+#endif
+}
+
+///Call f(i) for every i in [0,count) on threads threads, 0 for the hardware concurrency, taking indices dynamically.
+template<typename F>void parallelFor(const std::size_t& count,const F& f,std::size_t threads=0){
+    threads=std::min(count,threads?threads:std::max<std::size_t>(std::thread::hardware_concurrency(),1));
+    std::atomic<std::size_t> next=0;
+    const auto work=[&]{
+        for(std::size_t i;(i=next.fetch_add(1,std::memory_order_relaxed))<count;)
+            f(i);
+    };
+    std::vector<std::jthread> workers;
+    for(std::size_t i=1;i<threads;++i)
+        workers.emplace_back(work);
+    work();
+}
+
+/**
+ * Bytes of memory used, by category, accumulated by the memory() methods of the objects using it.
+ * Objects reached through several shared pointers are counted once.
+ * Allocator bookkeeping is estimated per heap block, and per node of the standard containers.
+ */
+struct MemoryUsage{
+    ///Bookkeeping of a heap block by the allocator, as in glibc malloc.
+    static constexpr std::size_t BLOCK=2*sizeof(void*);
+    ///Reference counts and deleter of a std::make_shared allocation.
+    static constexpr std::size_t CONTROL=2*sizeof(void*);
+    ///Acceleration structures: BvhNode arrays, their object indices, and the trees themselves.
+    std::size_t nodes=0;
+    ///Geometric objects.
+    std::size_t primitives=0;
+    ///Materials, lights and textures.
+    std::size_t materials=0;
+    ///Pixels and texture tiles.
+    std::size_t buffers=0;
+    ///Allocator and container bookkeeping.
+    std::size_t overhead=0;
+    std::unordered_set<const void*> seen;
+    [[nodiscard]] std::size_t total()const{return nodes+primitives+materials+buffers+overhead;}
+
+    ///@return true the first time object is passed, so that it should be counted now.
+    bool first(const void* object){return object&&seen.insert(object).second;}
+
+    ///Count the heap storage of vector in category.
+    template<typename T>void add(std::size_t& category,const std::vector<T>& vector){
+        if(vector.capacity())
+            category+=vector.capacity()*sizeof(T),overhead+=BLOCK;
+    }
+
+    ///Count an object of size bytes allocated by std::make_shared in category, unless it was counted.
+    void shared(std::size_t& category,const void* object,const std::size_t& size){
+        if(first(object))
+            category+=size,overhead+=CONTROL+BLOCK;
+    }
+};
+/**
+ * Scattering at a surface, where theoretic is the mirror reflection of the incoming direction.
+ * Scattering is lossless: possibility is both the density of generate and the scattering function times cosine.
+ */
 class Material{
 public:
     virtual ~Material()=0;
     [[nodiscard]] virtual double possibility(const Vector& theoretic,const Vector& real)const=0;
     [[nodiscard]] virtual Vector generate(const Vector& normal,const Vector& theoretic)const=0;
+
+    ///@return true if generate is deterministic, so that possibility is a probability rather than a density.
+    [[nodiscard]] virtual bool specular()const{return false;}
+
+    /**
+     * Scatter count pairs of normal and theoretic at once, with two uniform random numbers in [0,1) per pair from u and v,
+     * writing the directions to out and their possibility to possibilities.
+     * The arrays of different arguments must not overlap.
+     * By default generate() and possibility() are called per pair and u and v are unused; overrides write loops the compiler can vectorize.
+     */
+    virtual void generateBatch(const std::size_t& count,const Vectors& normals,const Vectors& theoretics,const double* u,const double* v,const Vectors& out,double* possibilities)const{
+        for(std::size_t i=0;i<count;++i){
+            const Vector direction=generate(normals[i],theoretics[i]);
+            out.set(i,direction),possibilities[i]=possibility(theoretics[i],direction);
+        }
+    }
 };
+inline Material::~Material()=default;
 class Aabb{
 public:
     Interval x,y,z;
+    Aabb():x(Interval::empty),y(Interval::empty),z(Interval::empty){}
     Aabb(const Interval& x,const Interval& y,const Interval& z):x(x),y(y),z(z){}
     Aabb(const Vector& a,const Vector& b):x{std::min(a.x,b.x),std::max(a.x,b.x)},y{std::min(a.y,b.y),std::max(a.y,b.y)},z{std::min(a.z,b.z),std::max(a.z,b.z)}{}
     Aabb(const Aabb& a,const Aabb& b):x(c3d::unite(a.x,b.x)),y(c3d::unite(a.y,b.y)),z(c3d::unite(a.z,b.z)){}
+    [[nodiscard]] const Interval& operator[](const std::size_t& i)const{return i==0?x:i==1?y:z;}
     [[nodiscard]] bool hit(const Vector& origin,const Vector& ray,Interval interval)const{
-        return !(interval.intersect({(x.min-origin.x)/ray.x,(x.max-origin.x)/ray.x}).isEmpty()
-               ||interval.intersect({(y.min-origin.y)/ray.y,(y.max-origin.y)/ray.y}).isEmpty()
-               ||interval.intersect({(z.min-origin.z)/ray.z,(z.max-origin.z)/ray.z}).isEmpty());
+        const auto slab=[](const Interval& i,const double& o,const double& d)->Interval{
+            const double a=(i.min-o)/d,b=(i.max-o)/d;
+            return a<b?Interval{a,b}:Interval{b,a};
+        };
+        return !(interval.intersect(slab(x,origin.x,ray.x)).isEmpty()
+               ||interval.intersect(slab(y,origin.y,ray.y)).isEmpty()
+               ||interval.intersect(slab(z,origin.z,ray.z)).isEmpty());
     }
     Aabb& unite(const Aabb& a){return x.unite(a.x),y.unite(a.y),z.unite(a.z),*this;}
+    [[nodiscard]] Vector center()const{return{(x.min+x.max)/2,(y.min+y.max)/2,(z.min+z.max)/2};}
+    ///@return Surface area of the box, 0 if it is empty.
+    [[nodiscard]] double area()const{
+        if(x.isEmpty()||y.isEmpty()||z.isEmpty())
+            return 0;
+        const double a=x.length(),b=y.length(),c=z.length();
+        return (a*b+b*c+c*a)*2;
+    }
+    ///@return 0, 1 or 2 for the longest axis among x, y and z.
+    [[nodiscard]] std::size_t longestAxis()const{
+        const double xLength=x.length(),yLength=y.length(),zLength=z.length();
+        return xLength>yLength&&xLength>zLength?0:yLength>zLength?1:2;
+    }
     static const Aabb empty;
 };
-const Aabb Aabb::empty{Interval::empty,Interval::empty,Interval::empty};
-inline Aabb unite(const std::initializer_list<const Aabb&>& aabbs){
+inline const Aabb Aabb::empty{Interval::empty,Interval::empty,Interval::empty};
+inline Aabb unite(const std::initializer_list<Aabb>& aabbs){
     Aabb ret=Aabb::empty;
     for(const auto& aabb:aabbs)
         ret.unite(aabb);
@@ -148,76 +468,3353 @@ struct Light{
     Color color;
     double brightness;
 };
+///Color over the (u,v) parameterization of a surface.
+class Texture{
+public:
+    virtual ~Texture()=0;
+
+    ///@return Color at (u,v) averaged over a square footprint of the given width in (u,v) units.
+    [[nodiscard]] virtual Color color(const double& u,const double& v,const double& footprint)const=0;
+
+    ///Add the memory of the texture to usage.
+    virtual void memory(MemoryUsage& usage)const{usage.shared(usage.materials,this,sizeof(Texture));}
+};
+inline Texture::~Texture()=default;
+class Hittable;
 struct HitRecord{
     Vector point,normal;
-    std::shared_ptr<const Light> light;
+    const Light* light;
     double dist;
-    std::shared_ptr<const Material> material;
+    const Material* material;
+    ///The primitive hit, which owns light, material and texture.
+    const Hittable* object;
+    ///Surface coordinates of the point, and their change per unit distance along the surface for filtering the texture.
+    double u=0,v=0,uvScale=0;
+    const Texture* texture=nullptr;
+
+    /**
+     * Every integrator scales the throughput of a path by this at each scattering vertex.
+     * @param width Width of the lookup along the surface, 0 for the finest level.
+     * @return Color of the texture at the point, white without one.
+     */
+    [[nodiscard]] Color albedo(const double& width=0)const{return texture?texture->color(u,v,width*uvScale):Color{1,1,1};}
 };
 class Hittable{
 public:
     virtual ~Hittable()=0;
-    [[nodiscard]] virtual std::shared_ptr<HitRecord> hit(const Vector& origin,const Vector& ray,const Interval& interval)const=0;
+    [[nodiscard]] virtual std::optional<HitRecord> hit(const Vector& origin,const Vector& ray,const Interval& interval)const=0;
     [[nodiscard]] virtual Aabb aabb()const=0;
+
+    ///Add the memory of the object and everything it owns to usage.
+    virtual void memory(MemoryUsage& usage)const{usage.shared(usage.primitives,this,sizeof(Hittable));}
 };
+inline Hittable::~Hittable()=default;
 class Mirror final:public Material{
 public:
     [[nodiscard]] double possibility(const Vector& theoretic,const Vector& real)const override{return real==theoretic?1:0;}
     [[nodiscard]] Vector generate(const Vector& normal,const Vector& theoretic)const override{return theoretic;}
+    [[nodiscard]] bool specular()const override{return true;}
+    void generateBatch(const std::size_t& count,const Vectors& normals,const Vectors& theoretics,const double* u,const double* v,const Vectors& out,double* possibilities)const override{
+        C3D_INDEPENDENT
+        for(std::size_t i=0;i<count;++i)
+            out.set(i,theoretics[i]),possibilities[i]=1;
+    }
+};
+
+///Material scattering uniformly over the hemisphere around the normal.
+class Diffuse final:public Material{
+public:
+    [[nodiscard]] double possibility(const Vector& theoretic,const Vector& real)const override{return 1/(2*PI);}
+    [[nodiscard]] Vector generate(const Vector& normal,const Vector& theoretic)const override{return RandVec3OnUnitHemisphere(threadGenerator(),normal);}
+
+    /**
+     * Height u over the tangent plane and angle 2*pi*v around the normal give a uniform direction on the hemisphere.
+     * The loop is branch-free and vectorizes, 4 directions per iteration with AVX2.
+     */
+    void generateBatch(const std::size_t& count,const Vectors& normals,const Vectors& theoretics,const double* u,const double* v,const Vectors& out,double* possibilities)const override{
+        C3D_INDEPENDENT
+        for(std::size_t i=0;i<count;++i){
+            const Vector n=normals[i];
+            Vector t,b;
+            orthonormalBasis(n,t,b);
+            //u<1, so the radius is real.
+            const double r=vectorSqrt(1-u[i]*u[i]);
+            double sine,cosine;
+            vectorSinCos2Pi(v[i],sine,cosine);
+            out.set(i,t*(cosine*r)+b*(sine*r)+n*u[i]),possibilities[i]=1/(2*PI);
+        }
+    }
+};
+
+///@return x with two zero bits inserted after each of its low 21 bits.
+inline std::uint64_t spreadBits(std::uint64_t x){
+    x&=0x1fffff;
+    x=(x|x<<32)&0x1f00000000ffff;
+    x=(x|x<<16)&0x1f0000ff0000ff;
+    x=(x|x<<8)&0x100f00f00f00f00f;
+    x=(x|x<<4)&0x10c30c30c30c30c3;
+    return (x|x<<2)&0x1249249249249249;
+}
+
+///@return Morton code of bits bits, a multiple of 3 up to 63, of point within bounds.
+inline std::uint64_t morton(const Vector& point,const Aabb& bounds,const std::uint32_t& bits){
+    const double cells=static_cast<double>(std::uint64_t(1)<<bits/3);
+    const auto quantize=[&](const double& x,const Interval& i){
+        const double t=i.max>i.min?(x-i.min)/(i.max-i.min):0;
+        return static_cast<std::uint64_t>(std::clamp(t*cells,0.,cells-1));
+    };
+    return spreadBits(quantize(point.x,bounds.x))<<2|spreadBits(quantize(point.y,bounds.y))<<1|spreadBits(quantize(point.z,bounds.z));
+}
+
+///Buffers of radixSort, which allocates nothing when they are reused for inputs no larger than before.
+struct RadixScratch{
+    static constexpr std::size_t DIGIT=8,RADIX=1<<DIGIT;
+    std::vector<std::uint64_t> keys;
+    std::vector<std::uint32_t> values;
+    std::vector<std::array<std::size_t,RADIX>> offsets;
+};
+
+/**
+ * Sort keys of bits bits with their values by least significant digit radix sort.
+ * Each pass counts digits of contiguous blocks in parallel, then scatters every block from its own offsets, so the result is stable and independent of threads.
+ */
+inline void radixSort(std::vector<std::uint64_t>& keys,std::vector<std::uint32_t>& values,const std::uint32_t& bits,const std::size_t& threads,RadixScratch& scratch){
+    constexpr std::size_t DIGIT=RadixScratch::DIGIT,RADIX=RadixScratch::RADIX;
+    const std::size_t blocks=std::clamp<std::size_t>(keys.size()/65536,1,std::max<std::size_t>(std::thread::hardware_concurrency(),1)*4),
+                      blockSize=(keys.size()+blocks-1)/blocks;
+    std::vector<std::uint64_t>& keyBuffer=scratch.keys;
+    std::vector<std::uint32_t>& valueBuffer=scratch.values;
+    std::vector<std::array<std::size_t,RADIX>>& offsets=scratch.offsets;
+    keyBuffer.resize(keys.size()),valueBuffer.resize(values.size()),offsets.resize(blocks);
+    for(std::uint32_t shift=0;shift<bits;shift+=DIGIT){
+        parallelFor(blocks,[&](const std::size_t& b){
+            offsets[b].fill(0);
+            for(std::size_t i=b*blockSize;i<std::min(keys.size(),(b+1)*blockSize);++i)
+                ++offsets[b][keys[i]>>shift&(RADIX-1)];
+        },threads);
+        for(std::size_t digit=0,sum=0;digit<RADIX;++digit)
+            for(auto& offset:offsets)
+                sum+=std::exchange(offset[digit],sum);
+        parallelFor(blocks,[&](const std::size_t& b){
+            for(std::size_t i=b*blockSize;i<std::min(keys.size(),(b+1)*blockSize);++i){
+                const std::size_t j=offsets[b][keys[i]>>shift&(RADIX-1)]++;
+                keyBuffer[j]=keys[i],valueBuffer[j]=values[i];
+            }
+        },threads);
+        keys.swap(keyBuffer),values.swap(valueBuffer);
+    }
+}
+inline void radixSort(std::vector<std::uint64_t>& keys,std::vector<std::uint32_t>& values,const std::uint32_t& bits,const std::size_t& threads=0){
+    RadixScratch scratch;
+    radixSort(keys,values,bits,threads,scratch);
+}
+
+enum class BvhBuilder{
+    ///Top-down, halving the objects at the median of the longest axis of their centers.
+    median,
+    ///Linear: sorted by the Morton codes of their centers, with the hierarchy read off the codes.
+    lbvh,
+    ///Agglomerative: clusters in Morton order merged with their nearest neighbours, slower to build but usually of lower SAH cost on uneven scenes.
+    ploc
+};
+
+///Parameters of a BvhTree build. Every field takes part in the BvhCache key.
+struct BvhOptions{
+    ///Maximum number of objects in a leaf, where 0 acts as 1.
+    std::uint32_t leafSize=4;
+    BvhBuilder builder=BvhBuilder::median;
+    ///Bits of the Morton codes of an lbvh or ploc build, 30 or 63.
+    std::uint32_t mortonBits=30;
+    ///Number of neighbours on each side in Morton order among which a ploc build searches the nearest cluster.
+    std::uint32_t searchRadius=16;
+    ///Keep the bounds in float as CompactBvhNode instead of BvhNode after the build, and test rays against those; objects are still tested in double.
+    bool compact=false;
+};
+
+/**
+ * Node of a flattened BvhTree, stored in depth-first order.
+ * An interior node has its left child right after itself and its right child at offset.
+ * A leaf holds objects [offset,offset+count) .
+ */
+struct BvhNode{
+    Aabb aabb;
+    std::uint32_t offset,count;
+};
+
+///@return The greatest float not above x.
+inline float roundDown(const double& x){
+    const auto f=static_cast<float>(x);
+    return f>x?std::nextafter(f,-std::numeric_limits<float>::infinity()):f;
+}
+
+///@return The least float not below x.
+inline float roundUp(const double& x){
+    const auto f=static_cast<float>(x);
+    return f<x?std::nextafter(f,std::numeric_limits<float>::infinity()):f;
+}
+
+///BvhNode with its bounds rounded outwards to float, so that it still contains its objects at half the size.
+struct CompactBvhNode{
+    float min[3],max[3];
+    std::uint32_t offset,count;
+    CompactBvhNode()=default;
+    explicit CompactBvhNode(const BvhNode& node):min{roundDown(node.aabb.x.min),roundDown(node.aabb.y.min),roundDown(node.aabb.z.min)},
+                                                max{roundUp(node.aabb.x.max),roundUp(node.aabb.y.max),roundUp(node.aabb.z.max)},offset(node.offset),count(node.count){}
+
+    ///@return The node with its float bounds, which contain the bounds it was made from.
+    [[nodiscard]] BvhNode expand()const{return{{{min[0],max[0]},{min[1],max[1]},{min[2],max[2]}},offset,count};}
+
+    /**
+     * Ray prepared for testing against CompactBvhNode in float.
+     * The rounding of the origin to float is covered by error, the distance it may shift the entry and exit of each slab.
+     */
+    struct Ray{
+        float origin[3],inverse[3],error[3];
+        Ray(const Vector& origin,const Vector& ray){
+            for(std::size_t i=0;i<3;++i){
+                this->origin[i]=static_cast<float>(origin[i]),inverse[i]=static_cast<float>(1/ray[i]);
+                const double shift=std::abs(static_cast<double>(this->origin[i])-origin[i]);
+                error[i]=shift>0?roundUp(shift*std::abs(1/ray[i])):0;
+            }
+        }
+    };
+
+    /**
+     * Test the slabs in float, widening the exit by the rounding error of the arithmetic as in pbrt.
+     * A NaN from a ray parallel to a slab leaves the range unchanged, so the test never misses a hit of the double precision test.
+     */
+    [[nodiscard]] bool hit(const Ray& ray,float near,float far)const{
+        constexpr float gamma=3*std::numeric_limits<float>::epsilon()/2/(1-3*std::numeric_limits<float>::epsilon()/2),scale=1+2*gamma;
+        for(std::size_t i=0;i<3;++i){
+            const float a=(min[i]-ray.origin[i])*ray.inverse[i],b=(max[i]-ray.origin[i])*ray.inverse[i],
+                        low=std::min(a,b)-ray.error[i],high=std::max(a,b)*scale+ray.error[i];
+            near=low>near?low:near,far=high<far?high:far;
+            if(near>far)
+                return false;
+        }
+        return true;
+    }
+};
+
+///64-bit FNV-1a hash of raw bytes, continued from hash.
+inline std::uint64_t fnv1a(std::uint64_t hash,const void* data,const std::size_t& size){
+    for(const auto* p=static_cast<const unsigned char*>(data),*end=p+size;p!=end;++p)
+        hash=(hash^*p)*0x100000001b3;
+    return hash;
+}
+
+/**
+ * On-disk cache of flattened BvhTree nodes in a local directory.
+ * Entries are keyed by a hash of the object bounds and the BvhOptions, which are all a build depends on.
+ * Entries are written to a temporary file and renamed, so concurrent processes may share a directory.
+ */
+class BvhCache{
+    struct Header{
+        char magic[8];
+        std::uint64_t key,nodes,indices;
+    };
+    static constexpr char MAGIC[8]={'c','3','d','b','v','h','\0','\1'};
+public:
+    std::filesystem::path directory;
+    ///Create directory if missing. If that fails, every load misses and every store is dropped.
+    explicit BvhCache(std::filesystem::path directory):directory(std::move(directory)){
+        std::error_code error;
+        std::filesystem::create_directories(this->directory,error);
+    }
+    [[nodiscard]] static std::uint64_t key(const std::vector<Aabb>& aabbs,const BvhOptions& options){
+        std::uint64_t hash=0xcbf29ce484222325;
+        const std::uint64_t layout[]={sizeof(BvhNode),sizeof(BvhOptions),aabbs.size()};
+        hash=fnv1a(hash,MAGIC,sizeof(MAGIC));
+        hash=fnv1a(hash,layout,sizeof(layout));
+        hash=fnv1a(hash,&options.leafSize,sizeof(options.leafSize));
+        hash=fnv1a(hash,&options.builder,sizeof(options.builder));
+        hash=fnv1a(hash,&options.mortonBits,sizeof(options.mortonBits));
+        hash=fnv1a(hash,&options.searchRadius,sizeof(options.searchRadius));
+        hash=fnv1a(hash,&options.compact,sizeof(options.compact));
+        return fnv1a(hash,aabbs.data(),aabbs.size()*sizeof(Aabb));
+    }
+    [[nodiscard]] std::filesystem::path path(const std::uint64_t& key)const{
+        char name[24];
+        std::snprintf(name,sizeof(name),"%016llx.bvh",static_cast<unsigned long long>(key));
+        return directory/name;
+    }
+
+    /**
+     * Load an entry by mapping its file into memory.
+     * @return true if the entry exists and is consistent with key and count objects, otherwise false.
+     */
+    bool load(const std::uint64_t& key,const std::size_t& count,std::vector<BvhNode>& nodes,std::vector<std::uint32_t>& indices)const{
+        const std::string file=path(key).string();
+        const auto read=[&](const char* data,const std::size_t& size){
+            Header header;
+            if(size<sizeof(Header))
+                return false;
+            std::memcpy(&header,data,sizeof(Header));
+            if(std::memcmp(header.magic,MAGIC,sizeof(MAGIC))||header.key!=key||header.indices!=count
+               ||size!=sizeof(Header)+header.nodes*sizeof(BvhNode)+header.indices*sizeof(std::uint32_t))
+                return false;
+            nodes.resize(header.nodes);
+            indices.resize(header.indices);
+            std::memcpy(nodes.data(),data+sizeof(Header),nodes.size()*sizeof(BvhNode));
+            std::memcpy(indices.data(),data+sizeof(Header)+nodes.size()*sizeof(BvhNode),indices.size()*sizeof(std::uint32_t));
+            return std::ranges::all_of(indices,[&](const std::uint32_t& i){return i<count;});
+        };
+#if defined(__unix__)||defined(__APPLE__)
+        const int fd=::open(file.c_str(),O_RDONLY);
+        if(fd<0)
+            return false;
+        struct stat info{};
+        bool ok=false;
+        if(::fstat(fd,&info)==0&&info.st_size>0)
+            if(void* data=::mmap(nullptr,info.st_size,PROT_READ,MAP_PRIVATE,fd,0);data!=MAP_FAILED)
+                ok=read(static_cast<const char*>(data),info.st_size),::munmap(data,info.st_size);
+        ::close(fd);
+        return ok;
+#else
+        std::ifstream in(file,std::ios::binary);
+        const std::string data{std::istreambuf_iterator<char>(in),std::istreambuf_iterator<char>()};
+        return in.good()||in.eof()?read(data.data(),data.size()):false;
+#endif
+    }
+
+    ///Store an entry. Failures are ignored since the cache is only an optimization.
+    void store(const std::uint64_t& key,const std::vector<BvhNode>& nodes,const std::vector<std::uint32_t>& indices)const{
+        const std::filesystem::path target=path(key);
+        std::filesystem::path temporary=target;
+        temporary+=".tmp"+std::to_string(std::random_device()());
+        Header header{};
+        std::memcpy(header.magic,MAGIC,sizeof(MAGIC));
+        header.key=key,header.nodes=nodes.size(),header.indices=indices.size();
+        std::ofstream out(temporary,std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+        out.write(reinterpret_cast<const char*>(nodes.data()),static_cast<std::streamsize>(nodes.size()*sizeof(BvhNode)));
+        out.write(reinterpret_cast<const char*>(indices.data()),static_cast<std::streamsize>(indices.size()*sizeof(std::uint32_t)));
+        //Closed before renaming or removing the file, so that a failed flush on close also drops the entry.
+        out.close();
+        std::error_code error;
+        if(out)
+            std::filesystem::rename(temporary,target,error);
+        if(!out||error)
+            std::filesystem::remove(temporary,error);
+    }
+};
+
+///Quality measures of a BvhTree, for comparing build strategies.
+struct BvhStats{
+    /**
+     * Expected cost of tracing a ray through the tree by the surface area heuristic, relative to the bounds of the root:
+     * traversal cost times the area of every interior node plus intersection cost times area times count of every leaf.
+     */
+    double sah=0;
+    ///Sum of the areas of the intersections of sibling bounds, relative to the area of the root.
+    double overlap=0;
+    std::size_t interiors=0,leaves=0,bytes=0;
+    ///Number of leaves at each depth, the root being at depth 0.
+    std::vector<std::size_t> depths;
+    ///Number of leaves of each object count.
+    std::vector<std::size_t> leafSizes;
 };
+
+class Sphere;
+
+///Bounding volume hierarchy over objects, flattened into an array of BvhNode.
 class BvhTree:public Hittable{
-    BvhTree(std::vector<std::shared_ptr<const Hittable>>& objects,std::vector<Aabb>& aabbs){
-        //TODO:sync with dev-java
-        if(const std::size_t n=objects.size();n==1)
-            left=objects.front(),aabb_=aabbs.front(),right=nullptr;
-        else if(n==2)
-            left=objects.front(),right=objects.back(),aabb_={aabbs.front(),aabbs.back()};
-        else{
-            aabb_=Aabb::empty;
-            for(const auto& a:aabbs)
-                aabb_.unite(a);
-            const double xLength=aabb_.x.length(),yLength=aabb_.y.length(),zLength=aabb_.z.length();
-            if(xLength>yLength&&xLength>zLength)
-
-        }
-    }
-public:
-    //TODO:sync with dev-java
-    std::shared_ptr<const Hittable> left,right;
-    Aabb aabb_;
-    explicit BvhTree(std::vector<std::shared_ptr<const Hittable>>& objects){
+    std::uint32_t build(std::vector<std::uint32_t>& indices,const std::vector<Aabb>& aabbs,const std::uint32_t& begin,const std::uint32_t& end,const BvhOptions& options){
+        const auto index=static_cast<std::uint32_t>(nodes.size());
+        nodes.push_back({Aabb::empty,begin,end-begin});
+        Aabb bounds=Aabb::empty,centers=Aabb::empty;
+        for(std::uint32_t i=begin;i<end;++i){
+            const Vector center=aabbs[indices[i]].center();
+            bounds.unite(aabbs[indices[i]]),centers.unite({center,center});
+        }
+        nodes[index].aabb=bounds;
+        if(end-begin<=std::max(options.leafSize,1u))
+            return index;
+        const std::size_t axis=centers.longestAxis();
+        const std::uint32_t middle=begin+(end-begin)/2;
+        std::nth_element(indices.begin()+begin,indices.begin()+middle,indices.begin()+end,[&](const std::uint32_t& a,const std::uint32_t& b){
+            return aabbs[a].center()[axis]<aabbs[b].center()[axis];
+        });
+        build(indices,aabbs,begin,middle,options);
+        const std::uint32_t right=build(indices,aabbs,middle,end,options);
+        nodes[index].offset=right,nodes[index].count=0;
+        return index;
+    }
+
+    /**
+     * Build by sorting the objects by the Morton codes of their centers and splitting every range at its highest differing bit, after Karras.
+     * The ranges and bounds of all interior nodes are found in parallel; the tree is then flattened depth-first, collapsing ranges of at most leafSize objects.
+     */
+    void buildLinear(std::vector<std::uint32_t>& indices,const std::vector<Aabb>& aabbs,const BvhOptions& options){
+        constexpr std::size_t BLOCK=4096;
+        constexpr std::uint32_t LEAF=0x80000000;
+        const auto n=static_cast<std::uint32_t>(aabbs.size());
+        const std::uint32_t bits=options.mortonBits>30?63:30;
+        const std::size_t blocks=(n+BLOCK-1)/BLOCK;
+        Aabb centers=Aabb::empty;
+        for(const Aabb& aabb:aabbs)
+            centers.unite({aabb.center(),aabb.center()});
+        std::vector<std::uint64_t> codes(n);
+        parallelFor(blocks,[&](const std::size_t& b){
+            for(std::size_t i=b*BLOCK;i<std::min<std::size_t>(n,(b+1)*BLOCK);++i)
+                codes[i]=morton(aabbs[i].center(),centers,bits);
+        });
+        radixSort(codes,indices,bits);
+        if(n==1)
+            return nodes.push_back({aabbs[indices[0]],0,1});
+        struct Internal{
+            std::uint32_t left,right,first,last,parent;
+            Aabb aabb;
+            std::atomic<std::uint32_t> visits=0;
+        };
+        std::vector<Internal> internals(n-1);
+        std::vector<std::uint32_t> parents(n);
+        const auto delta=[&](const std::int64_t& i,const std::int64_t& j){
+            if(j<0||j>=n)
+                return -1;
+            return codes[i]==codes[j]?64+std::countl_zero(static_cast<std::uint32_t>(i^j)):std::countl_zero(codes[i]^codes[j]);
+        };
+        parallelFor((n-1+BLOCK-1)/BLOCK,[&](const std::size_t& b){
+            for(std::int64_t i=static_cast<std::int64_t>(b*BLOCK);i<std::min<std::int64_t>(n-1,static_cast<std::int64_t>((b+1)*BLOCK));++i){
+                const std::int64_t d=delta(i,i+1)>delta(i,i-1)?1:-1;
+                const int minimum=delta(i,i-d);
+                std::int64_t length=2,l=0;
+                while(delta(i,i+length*d)>minimum)
+                    length*=2;
+                for(std::int64_t t=length/2;t;t/=2)
+                    if(delta(i,i+(l+t)*d)>minimum)
+                        l+=t;
+                const std::int64_t j=i+l*d;
+                const int prefix=delta(i,j);
+                std::int64_t s=0;
+                for(std::int64_t t=(l+1)/2;;t=(t+1)/2){
+                    if(delta(i,i+(s+t)*d)>prefix)
+                        s+=t;
+                    if(t==1)
+                        break;
+                }
+                const auto split=static_cast<std::uint32_t>(i+s*d+std::min<std::int64_t>(d,0)),first=static_cast<std::uint32_t>(std::min(i,j)),last=static_cast<std::uint32_t>(std::max(i,j));
+                Internal& node=internals[i];
+                node.first=first,node.last=last;
+                node.left=first==split?split|LEAF:split;
+                node.right=last==split+1?(split+1)|LEAF:split+1;
+                (node.left&LEAF?parents[split]:internals[split].parent)=static_cast<std::uint32_t>(i);
+                (node.right&LEAF?parents[split+1]:internals[split+1].parent)=static_cast<std::uint32_t>(i);
+            }
+        });
+        const auto bounds=[&](const std::uint32_t& child)->const Aabb&{return child&LEAF?aabbs[indices[child&~LEAF]]:internals[child].aabb;};
+        parallelFor(blocks,[&](const std::size_t& b){
+            for(std::size_t i=b*BLOCK;i<std::min<std::size_t>(n,(b+1)*BLOCK);++i)
+                for(std::uint32_t p=parents[i];internals[p].visits.fetch_add(1,std::memory_order_acq_rel);p=internals[p].parent){
+                    internals[p].aabb=Aabb(bounds(internals[p].left),bounds(internals[p].right));
+                    if(!p)
+                        break;
+                }
+        });
+        const auto flatten=[&](const auto& self,const std::uint32_t& child)->std::uint32_t{
+            const auto index=static_cast<std::uint32_t>(nodes.size());
+            if(child&LEAF)
+                return nodes.push_back({bounds(child),child&~LEAF,1}),index;
+            const Internal& node=internals[child];
+            if(node.last-node.first<options.leafSize)
+                return nodes.push_back({node.aabb,node.first,node.last-node.first+1}),index;
+            nodes.push_back({node.aabb,0,0});
+            self(self,node.left);
+            nodes[index].offset=self(self,node.right);
+            return index;
+        };
+        flatten(flatten,0);
+    }
+
+    /**
+     * Build bottom-up by parallel locally-ordered clustering (PLOC): clusters start as objects in Morton order,
+     * each finds in parallel the neighbour within searchRadius positions whose union with it has the least area, and mutual nearest neighbours merge in place.
+     * The tree is then flattened depth-first, gathering clusters of at most leafSize objects into leaves.
+     */
+    void buildClustered(std::vector<std::uint32_t>& indices,const std::vector<Aabb>& aabbs,const BvhOptions& options){
+        constexpr std::size_t BLOCK=1024;
+        constexpr std::uint32_t NONE=~0u;
+        struct Cluster{
+            Aabb aabb;
+            ///Children, or the object and NONE for a single object.
+            std::uint32_t left,right,count;
+        };
+        const auto n=static_cast<std::uint32_t>(aabbs.size());
+        const std::uint32_t bits=options.mortonBits>30?63:30;
+        Aabb centers=Aabb::empty;
+        for(const Aabb& aabb:aabbs)
+            centers.unite({aabb.center(),aabb.center()});
+        std::vector<std::uint64_t> codes(n);
+        parallelFor((n+BLOCK-1)/BLOCK,[&](const std::size_t& b){
+            for(std::size_t i=b*BLOCK;i<std::min<std::size_t>(n,(b+1)*BLOCK);++i)
+                codes[i]=morton(aabbs[i].center(),centers,bits);
+        });
+        radixSort(codes,indices,bits);
+        std::vector<Cluster> clusters;
+        clusters.reserve(std::size_t(n)*2-1);
+        std::vector<std::uint32_t> active(n),nearest,next;
+        for(std::uint32_t i=0;i<n;++i)
+            clusters.push_back({aabbs[indices[i]],indices[i],NONE,1}),active[i]=i;
+        while(active.size()>1){
+            const std::size_t m=active.size(),radius=std::max(options.searchRadius,1u);
+            nearest.resize(m);
+            parallelFor((m+BLOCK-1)/BLOCK,[&](const std::size_t& b){
+                for(std::size_t i=b*BLOCK;i<std::min(m,(b+1)*BLOCK);++i){
+                    std::tuple<double,std::size_t,std::size_t> best{INF,m,m};
+                    for(std::size_t j=i>radius?i-radius:0;j<std::min(m,i+radius+1);++j)
+                        if(j!=i)
+                            if(const std::tuple candidate{Aabb(clusters[active[i]].aabb,clusters[active[j]].aabb).area(),std::min(i,j),std::max(i,j)};candidate<best)
+                                best=candidate,nearest[i]=static_cast<std::uint32_t>(j);
+                }
+            });
+            next.clear();
+            for(std::size_t i=0;i<m;++i){
+                const std::uint32_t j=nearest[i];
+                if(nearest[j]!=i)
+                    next.push_back(active[i]);
+                else if(i<j){
+                    const Cluster& a=clusters[active[i]];
+                    const Cluster& b=clusters[active[j]];
+                    const Cluster merged{Aabb(a.aabb,b.aabb),active[i],active[j],a.count+b.count};
+                    next.push_back(static_cast<std::uint32_t>(clusters.size()));
+                    clusters.push_back(merged);
+                }
+            }
+            active.swap(next);
+        }
+        indices.clear();
+        const auto gather=[&](const auto& self,const std::uint32_t& c)->void{
+            if(clusters[c].right==NONE)
+                return indices.push_back(clusters[c].left);
+            self(self,clusters[c].left),self(self,clusters[c].right);
+        };
+        const auto flatten=[&](const auto& self,const std::uint32_t& c)->std::uint32_t{
+            const auto index=static_cast<std::uint32_t>(nodes.size());
+            const Cluster& cluster=clusters[c];
+            if(cluster.count<=options.leafSize||cluster.right==NONE){
+                nodes.push_back({cluster.aabb,static_cast<std::uint32_t>(indices.size()),cluster.count});
+                gather(gather,c);
+                return index;
+            }
+            nodes.push_back({cluster.aabb,0,0});
+            self(self,cluster.left);
+            nodes[index].offset=self(self,cluster.right);
+            return index;
+        };
+        flatten(flatten,active[0]);
+    }
+
+    ///Find the closest hit, visiting the nodes of array that test(node,range) accepts.
+    template<typename Node,typename F>[[nodiscard]] std::optional<HitRecord> traverse(const std::vector<Node>& array,const Vector& origin,const Vector& ray,Interval range,const F& test)const{
+        std::optional<HitRecord> closest;
+        //Trees deeper than the local stack, such as clustered builds over geometric distributions, push onto a thread_local one,
+        //addressed from base since traversals of nested trees share it.
+        thread_local std::vector<std::uint32_t> spill;
+        std::uint32_t local[STACK],i=0;
+        const bool deep=height>STACK;
+        const std::size_t base=spill.size();
+        if(deep)
+            spill.resize(base+height);
+        std::size_t size=0;
+        while(true){
+            if(const Node& node=array[i];test(node,range)){
+                if(!node.count){
+                    (deep?spill[base+size]:local[size])=node.offset,++size,++i;
+                    continue;
+                }
+                for(std::uint32_t j=node.offset;j<node.offset+node.count;++j)
+                    if(auto record=hitObject(j,origin,ray,range))
+                        range.max=record->dist,closest=record;
+            }
+            if(!size)
+                break;
+            --size,i=deep?spill[base+size]:local[size];
+        }
+        if(deep)
+            spill.resize(base);
+        return closest;
+    }
+    ///Number of entries of the traversal stack kept on the call stack.
+    static constexpr std::uint32_t STACK=64;
+
+    ///Whether each object is a Sphere, set by classify().
+    std::vector<char> spheres;
+    void classify();
+
+    ///@return The hit of object j, calling Sphere::hit directly so that it is inlined into the traversal dispatched for the Isa.
+    [[nodiscard]] std::optional<HitRecord> hitObject(const std::uint32_t& j,const Vector& origin,const Vector& ray,const Interval& range)const;
+public:
+    ///Nodes of the tree, empty if BvhOptions::compact.
+    std::vector<BvhNode> nodes;
+    ///Nodes of the tree with float bounds if BvhOptions::compact, otherwise empty.
+    std::vector<CompactBvhNode> compact;
+    ///Largest number of interior nodes on a path from the root, which bounds the traversal stack.
+    std::uint32_t height=0;
+    std::vector<std::shared_ptr<const Hittable>> objects;
+
+    /**
+     * Build the tree, or load it from cache if an entry for the same bounds and options exists.
+     * @param objects Objects to be held, reordered by the tree.
+     * @param cache Optional on-disk cache, updated after a miss.
+     */
+    explicit BvhTree(std::vector<std::shared_ptr<const Hittable>> objects,const BvhOptions& options={},const BvhCache* cache=nullptr){
         std::vector<Aabb> aabbs;
+        aabbs.reserve(objects.size());
         for(const auto &o:objects)
             aabbs.emplace_back(o->aabb());
-        *this(objects,aabbs);
+        std::vector<std::uint32_t> indices;
+        const std::uint64_t key=cache?BvhCache::key(aabbs,options):0;
+        if(!cache||!cache->load(key,objects.size(),nodes,indices)){
+            nodes.clear();
+            indices.resize(objects.size());
+            for(std::uint32_t i=0;i<indices.size();++i)
+                indices[i]=i;
+            nodes.reserve(objects.size()/std::max(options.leafSize,1u)*2+1);
+            if(!objects.empty())
+                switch(options.builder){
+                case BvhBuilder::median:
+                    build(indices,aabbs,0,static_cast<std::uint32_t>(indices.size()),options);
+                    break;
+                case BvhBuilder::lbvh:
+                    buildLinear(indices,aabbs,options);
+                    break;
+                case BvhBuilder::ploc:
+                    buildClustered(indices,aabbs,options);
+                    break;
+                }
+            if(cache)
+                cache->store(key,nodes,indices);
+        }
+        std::vector<std::uint32_t> depths(nodes.size(),0);
+        for(std::size_t i=0;i<nodes.size();++i)
+            if(!nodes[i].count){
+                depths[i+1]=depths[nodes[i].offset]=depths[i]+1;
+                height=std::max(height,depths[i+1]);
+            }
+        this->objects.reserve(indices.size());
+        for(const auto& i:indices)
+            this->objects.push_back(objects[i]);
+        classify();
+        if(options.compact){
+            compact.reserve(nodes.size());
+            for(const BvhNode& node:nodes)
+                compact.emplace_back(node);
+            std::vector<BvhNode>().swap(nodes);
+        }
+    }
+
+    ///@return Number of nodes, in either representation.
+    [[nodiscard]] std::size_t size()const{return nodes.size()+compact.size();}
+
+    ///@return Node i, with its float bounds if the tree is compact.
+    [[nodiscard]] BvhNode node(const std::size_t& i)const{return compact.empty()?nodes[i]:compact[i].expand();}
+
+    [[nodiscard]] std::optional<HitRecord> hit(const Vector& origin,const Vector& ray,const Interval&interval)const override{
+        if(!size())
+            return std::nullopt;
+        return dispatch([&]{
+            if(!compact.empty()){
+                const CompactBvhNode::Ray prepared(origin,ray);
+                return traverse(compact,origin,ray,interval,[&](const CompactBvhNode& node,const Interval& range){
+                    return node.hit(prepared,roundDown(range.min),roundUp(range.max));
+                });
+            }
+            return traverse(nodes,origin,ray,interval,[&](const BvhNode& node,const Interval& range){return node.aabb.hit(origin,ray,range);});
+        });
+    }
+    [[nodiscard]] Aabb aabb()const override{return size()?node(0).aabb:Aabb::empty;}
+
+    ///@return Quality measures of the tree, weighing interior nodes by traversal and objects by intersection in the SAH cost.
+    [[nodiscard]] BvhStats stats(const double& traversal=1,const double& intersection=1)const{
+        BvhStats ret;
+        ret.bytes=nodes.size()*sizeof(BvhNode)+compact.size()*sizeof(CompactBvhNode)+objects.size()*(sizeof(objects[0])+sizeof(spheres[0]));
+        if(!size())
+            return ret;
+        const double root=std::max(node(0).aabb.area(),EPSILON);
+        std::vector<std::pair<std::uint32_t,std::size_t>> stack{{0,0}};
+        while(!stack.empty()){
+            const auto [i,depth]=stack.back();
+            const BvhNode node=this->node(i);
+            stack.pop_back();
+            if(node.count){
+                ++ret.leaves,ret.sah+=intersection*node.aabb.area()*node.count/root;
+                ret.depths.resize(std::max(ret.depths.size(),depth+1)),++ret.depths[depth];
+                ret.leafSizes.resize(std::max<std::size_t>(ret.leafSizes.size(),node.count+1)),++ret.leafSizes[node.count];
+                continue;
+            }
+            const Aabb a=this->node(i+1).aabb,b=this->node(node.offset).aabb;
+            ++ret.interiors,ret.sah+=traversal*node.aabb.area()/root;
+            ret.overlap+=Aabb(Interval(a.x).intersect(b.x),Interval(a.y).intersect(b.y),Interval(a.z).intersect(b.z)).area()/root;
+            stack.emplace_back(node.offset,depth+1),stack.emplace_back(i+1,depth+1);
+        }
+        return ret;
+    }
+
+    /**
+     * Write the bounds of every leaf as a box in Wavefront OBJ format, for visualization.
+     * @return true on success, otherwise false.
+     */
+    bool exportLeaves(const std::filesystem::path& file)const{
+        static constexpr std::size_t FACES[6][4]={{0,2,3,1},{4,5,7,6},{0,1,5,4},{2,6,7,3},{0,4,6,2},{1,3,7,5}};
+        std::ofstream out(file);
+        //Enough digits to read back the exact bounds.
+        out<<std::setprecision(std::numeric_limits<double>::max_digits10);
+        std::size_t vertices=0;
+        for(std::size_t i=0;i<size();++i){
+            const BvhNode node=this->node(i);
+            if(!node.count)
+                continue;
+            for(std::size_t corner=0;corner<8;++corner)
+                out<<"v "<<(corner&1?node.aabb.x.max:node.aabb.x.min)<<' '<<(corner&2?node.aabb.y.max:node.aabb.y.min)<<' '<<(corner&4?node.aabb.z.max:node.aabb.z.min)<<'\n';
+            for(const auto& face:FACES)
+                out<<"f "<<vertices+face[0]+1<<' '<<vertices+face[1]+1<<' '<<vertices+face[2]+1<<' '<<vertices+face[3]+1<<'\n';
+            vertices+=8;
+        }
+        return static_cast<bool>(out);
+    }
+    /**
+     * Count the tree and its objects. The tree may live on the stack, so an owner holding it by std::make_shared,
+     * like Scene, adds MemoryUsage::CONTROL and MemoryUsage::BLOCK itself.
+     */
+    void memory(MemoryUsage& usage)const override{
+        if(!usage.first(this))
+            return;
+        usage.nodes+=sizeof(BvhTree);
+        usage.add(usage.nodes,nodes),usage.add(usage.nodes,compact),usage.add(usage.nodes,objects),usage.add(usage.nodes,spheres);
+        for(const auto& object:objects)
+            object->memory(usage);
     }
-    [[nodiscard]] std::shared_ptr<HitRecord> hit(const Vector& origin,const Vector& ray,const Interval&interval)const override{
-        //TODO:sync with dev-java
+
+    ///Recompute the bounds of all nodes bottom-up after objects moved, keeping the topology.
+    void refit(){
+        classify();
+        for(std::size_t i=size();i--;){
+            BvhNode node=this->node(i);
+            if(node.count){
+                node.aabb=Aabb::empty;
+                for(std::uint32_t j=node.offset;j<node.offset+node.count;++j)
+                    node.aabb.unite(objects[j]->aabb());
+            }else
+                node.aabb={this->node(i+1).aabb,this->node(node.offset).aabb};
+            if(compact.empty())
+                nodes[i]=node;
+            else
+                compact[i]=CompactBvhNode(node);
+        }
     }
-    [[nodiscard]] Aabb aabb()const override{return aabb_;}
 };
-class Sphere final:public Hittable{
+
+/**
+ * Editable set of objects addressed by handles.
+ * Objects are grouped into chunks, each with its own BvhTree below a top-level BvhTree over the chunks.
+ * An edit only marks its chunk dirty; dirty chunks are refit or rebuilt by commit(), which the next trace calls implicitly.
+ * Edits must not run concurrently with tracing.
+ */
+class Scene:public Hittable{
 public:
-    Vector center;
-    double radius;
-    std::shared_ptr<Light> light;
-    std::shared_ptr<Material> material;
-    [[nodiscard]] std::shared_ptr<HitRecord> hit(const Vector& origin,const Vector& ray,const Interval&interval)const override{
-        //TODO:sync with dev-java
-        const Vector co=origin-center;
-        const double b=ray*co,d=b*b-normSq(co)+radius*radius;
-        if(d<0)
-            return nullptr;
-        const double sd=std::sqrt(d);
-        double t=-b-sd;
-        if(t<EPSILON)
-            t+=sd*2;
-        if(t<EPSILON)
+    using Handle=std::uint64_t;
+private:
+    enum class State{clean,refit,rebuild};
+    struct Chunk{
+        std::vector<std::shared_ptr<const Hittable>> objects;
+        std::vector<Handle> handles;
+        Aabb bounds;
+        mutable std::shared_ptr<BvhTree> tree;
+        mutable State state=State::rebuild;
+    };
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    std::unordered_map<Handle,std::pair<Chunk*,std::size_t>> locations;
+    Handle next=0;
+    mutable std::shared_ptr<const BvhTree> top;
+    mutable State topState=State::clean;
+    mutable std::atomic<bool> dirty=false;
+    mutable std::mutex mutex;
+    void mark(Chunk& chunk,const State& state){
+        chunk.state=std::max(chunk.state,state);
+        topState=std::max(topState,State::refit);
+        dirty.store(true,std::memory_order_release);
+    }
+    void commitLocked()const{
+        for(const auto& chunk:chunks){
+            if(chunk->state==State::rebuild){
+                if(chunk->tree)
+                    *chunk->tree=BvhTree(chunk->objects,options);
+                else
+                    chunk->tree=std::make_shared<BvhTree>(chunk->objects,options),topState=State::rebuild;
+            }else if(chunk->state==State::refit)
+                chunk->tree->refit();
+            chunk->bounds=chunk->tree->aabb(),chunk->state=State::clean;
+        }
+        if(topState==State::rebuild){
+            std::vector<std::shared_ptr<const Hittable>> trees;
+            for(const auto& chunk:chunks)
+                trees.push_back(chunk->tree);
+            top=std::make_shared<const BvhTree>(std::move(trees));
+        }else if(topState==State::refit)
+            std::const_pointer_cast<BvhTree>(top)->refit();
+        topState=State::clean;
+    }
+public:
+    ///Maximum number of objects in a chunk, which bounds the work of rebuilding one.
+    std::uint32_t chunkSize;
+    BvhOptions options;
+    explicit Scene(const std::uint32_t& chunkSize=64,const BvhOptions& options={}):chunkSize(std::max(chunkSize,1u)),options(options){}
+
+    /**
+     * Insert an object into the non-full chunk whose bounds grow the least.
+     * @return Handle of the object.
+     */
+    Handle insert(std::shared_ptr<const Hittable> object){
+        const Aabb aabb=object->aabb();
+        Chunk* best=nullptr;
+        double bestGrowth=INF;
+        for(const auto& chunk:chunks)
+            if(chunk->objects.size()<chunkSize)
+                if(const double growth=Aabb(chunk->bounds,aabb).area()-chunk->bounds.area();growth<bestGrowth)
+                    best=chunk.get(),bestGrowth=growth;
+        if(!best)
+            best=chunks.emplace_back(std::make_unique<Chunk>()).get();
+        best->bounds.unite(aabb);
+        best->objects.push_back(std::move(object));
+        best->handles.push_back(next);
+        locations.emplace(next,std::pair{best,best->objects.size()-1});
+        mark(*best,State::rebuild);
+        return next++;
+    }
+
+    ///Remove an object. Unknown handles are ignored.
+    void remove(const Handle& handle){
+        const auto it=locations.find(handle);
+        if(it==locations.end())
+            return;
+        const auto [chunk,slot]=it->second;
+        locations.erase(it);
+        if(slot+1!=chunk->objects.size()){
+            chunk->objects[slot]=std::move(chunk->objects.back());
+            chunk->handles[slot]=chunk->handles.back();
+            locations[chunk->handles[slot]].second=slot;
+        }
+        chunk->objects.pop_back(),chunk->handles.pop_back();
+        if(chunk->objects.empty()){
+            std::erase_if(chunks,[&](const std::unique_ptr<Chunk>& c){return c.get()==chunk;});
+            topState=State::rebuild;
+            dirty.store(true,std::memory_order_release);
+        }else
+            mark(*chunk,State::rebuild);
+    }
+
+    ///Notify that an object was modified in place, so its chunk is refit.
+    void update(const Handle& handle){
+        if(const auto it=locations.find(handle);it!=locations.end())
+            mark(*it->second.first,State::refit);
+    }
+
+    ///Replace an object, so its chunk is rebuilt.
+    void update(const Handle& handle,std::shared_ptr<const Hittable> object){
+        if(const auto it=locations.find(handle);it!=locations.end()){
+            const auto [chunk,slot]=it->second;
+            chunk->objects[slot]=std::move(object);
+            mark(*chunk,State::rebuild);
+        }
+    }
+
+    ///@return The object of a handle, or nullptr if the handle is unknown.
+    [[nodiscard]] std::shared_ptr<const Hittable> get(const Handle& handle)const{
+        const auto it=locations.find(handle);
+        return it==locations.end()?nullptr:it->second.first->objects[it->second.second];
+    }
+    [[nodiscard]] std::size_t size()const{return locations.size();}
+
+    ///Refit or rebuild the dirty chunks and the top-level tree.
+    void commit()const{
+        if(!dirty.load(std::memory_order_acquire))
+            return;
+        std::lock_guard lock(mutex);
+        if(dirty.load(std::memory_order_relaxed))
+            commitLocked(),dirty.store(false,std::memory_order_release);
+    }
+    [[nodiscard]] std::optional<HitRecord> hit(const Vector& origin,const Vector& ray,const Interval&interval)const override{
+        commit();
+        return top?top->hit(origin,ray,interval):std::nullopt;
+    }
+    [[nodiscard]] Aabb aabb()const override{
+        commit();
+        return top?top->aabb():Aabb::empty;
+    }
+    void memory(MemoryUsage& usage)const override{
+        if(!usage.first(this))
+            return;
+        std::lock_guard lock(mutex);
+        usage.nodes+=sizeof(Scene);
+        usage.add(usage.nodes,chunks);
+        usage.overhead+=locations.bucket_count()*sizeof(void*)+locations.size()*(sizeof(void*)+sizeof(decltype(locations)::value_type)+MemoryUsage::BLOCK);
+        for(const auto& chunk:chunks){
+            usage.nodes+=sizeof(Chunk),usage.overhead+=MemoryUsage::BLOCK;
+            usage.add(usage.nodes,chunk->objects),usage.add(usage.nodes,chunk->handles);
+            for(const auto& object:chunk->objects)
+                object->memory(usage);
+            if(chunk->tree)
+                usage.overhead+=MemoryUsage::CONTROL+MemoryUsage::BLOCK,chunk->tree->memory(usage);
+        }
+        if(top)
+            usage.overhead+=MemoryUsage::CONTROL+MemoryUsage::BLOCK,top->memory(usage);
+    }
+};
+/**
+ * Least-recently-used cache of texture tiles shared by all threads, holding at most capacity bytes.
+ * A tile stays alive while a thread uses it even if it has been evicted meanwhile.
+ */
+class TextureCache{
+public:
+    using Tile=std::vector<float>;
+    ///Tile (column,row) of a mip level of the texture identified by identify().
+    struct Key{
+        std::uint32_t texture,level,row,column;
+        [[nodiscard]] bool operator==(const Key&)const=default;
+    };
+    struct Hash{
+        [[nodiscard]] std::size_t operator()(const Key& key)const{return fnv1a(0xcbf29ce484222325,&key,sizeof(key));}
+    };
+private:
+    struct Entry{
+        std::shared_ptr<const Tile> tile;
+        std::list<Key>::iterator use;
+    };
+    mutable std::mutex mutex;
+    std::list<Key> uses;
+    std::unordered_map<Key,Entry,Hash> entries;
+    ///Tiles being read by one thread, which other threads missing them wait for instead of reading them again.
+    std::unordered_map<Key,std::shared_future<std::shared_ptr<const Tile>>,Hash> loading;
+    std::size_t bytes=0;
+    std::atomic<std::uint32_t> textures=0;
+
+    ///@return The cached tile of key marked as most recently used, or nullptr. mutex must be held.
+    [[nodiscard]] std::shared_ptr<const Tile> find(const Key& key){
+        const auto i=entries.find(key);
+        if(i==entries.end())
             return nullptr;
-        const Vector point=origin+ray*t;
-        return std::make_shared<HitRecord>(HitRecord{point,(point-center).unitize(),light,t,material});
+        uses.splice(uses.begin(),uses,i->second.use);
+        return i->second.tile;
+    }
+public:
+    std::size_t capacity;
+    explicit TextureCache(const std::size_t& capacity=256<<20):capacity(capacity){}
+
+    ///@return A new identifier for a texture using the cache.
+    [[nodiscard]] std::uint32_t identify(){return textures.fetch_add(1,std::memory_order_relaxed);}
+
+    ///@return Total bytes of the cached tiles.
+    [[nodiscard]] std::size_t size()const{
+        std::lock_guard lock(mutex);
+        return bytes;
+    }
+
+    /**
+     * @return The tile of key, calling load to read it on a miss.
+     * Concurrent misses of one key call load once, and an exception it throws is rethrown to all of them.
+     */
+    template<typename F>[[nodiscard]] std::shared_ptr<const Tile> get(const Key& key,const F& load){
+        {
+            std::lock_guard lock(mutex);
+            if(auto tile=find(key))
+                return tile;
+        }
+        //A miss reads from disk into a new tile, allowed even where allocation is forbidden.
+        const AllocationScope scope(false);
+        std::promise<std::shared_ptr<const Tile>> promise;
+        std::shared_future<std::shared_ptr<const Tile>> pending;
+        {
+            std::lock_guard lock(mutex);
+            if(auto tile=find(key))
+                return tile;
+            if(const auto i=loading.find(key);i!=loading.end())
+                pending=i->second;
+            else
+                loading.emplace(key,promise.get_future().share());
+        }
+        if(pending.valid())
+            return pending.get();
+        std::shared_ptr<const Tile> tile;
+        try{
+            tile=std::make_shared<const Tile>(load());
+        }catch(...){
+            promise.set_exception(std::current_exception());
+            std::lock_guard lock(mutex);
+            loading.erase(key);
+            throw;
+        }
+        promise.set_value(tile);
+        std::lock_guard lock(mutex);
+        loading.erase(key);
+        uses.push_front(key);
+        entries.emplace(key,Entry{tile,uses.begin()});
+        bytes+=tile->size()*sizeof(float);
+        while(bytes>capacity&&uses.size()>1){
+            const auto i=entries.find(uses.back());
+            bytes-=i->second.tile->size()*sizeof(float);
+            entries.erase(i);
+            uses.pop_back();
+        }
+        return tile;
+    }
+
+    void clear(){
+        std::lock_guard lock(mutex);
+        uses.clear(),entries.clear(),bytes=0;
+    }
+
+    ///Count the cached tiles as buffers, and the bookkeeping of each as overhead.
+    void memory(MemoryUsage& usage)const{
+        if(!usage.first(this))
+            return;
+        std::lock_guard lock(mutex);
+        constexpr std::size_t entry=2*sizeof(void*)+sizeof(Key)+sizeof(void*)+sizeof(decltype(entries)::value_type)+sizeof(Tile)
+                                    +MemoryUsage::CONTROL+4*MemoryUsage::BLOCK;
+        usage.buffers+=bytes;
+        usage.overhead+=sizeof(TextureCache)+entries.bucket_count()*sizeof(void*)+entries.size()*entry;
     }
-    [[nodiscard]] Aabb aabb()const override{return{{center.x-radius,center.x+radius},{center.y-radius,center.y+radius},{center.z-radius,center.z+radius}};}
 };
+
+/**
+ * Texture stored on disk as a chain of mip levels cut into square tiles of RGB floats, read lazily through a TextureCache.
+ * Lookups blend bilinear samples of the two levels nearest to the footprint, repeating the texture outside [0,1]^2.
+ */
+class TiledTexture final:public Texture{
+    struct Header{
+        char magic[8];
+        std::uint32_t width,height,tileSize,levels;
+    };
+    static constexpr char MAGIC[8]={'c','3','d','t','e','x','\0','\1'};
+    struct Level{
+        std::uint32_t width,height,columns;
+        std::uint64_t offset;
+    };
+    std::filesystem::path file;
+    std::shared_ptr<TextureCache> cache;
+    std::uint32_t id,tileSize;
+    std::vector<Level> levels;
+#if defined(__unix__)||defined(__APPLE__)
+    int fd=-1;
+#endif
+    [[nodiscard]] std::size_t tileBytes()const{return std::size_t(tileSize)*tileSize*3*sizeof(float);}
+    static std::vector<Level> layout(std::uint32_t width,std::uint32_t height,const std::uint32_t& tileSize,const std::uint32_t& count){
+        std::vector<Level> ret;
+        std::uint64_t offset=sizeof(Header);
+        for(std::uint32_t i=0;i<count;++i,width=std::max(width/2,1u),height=std::max(height/2,1u)){
+            const std::uint32_t columns=(width+tileSize-1)/tileSize,rows=(height+tileSize-1)/tileSize;
+            ret.push_back({width,height,columns,offset});
+            offset+=std::uint64_t(columns)*rows*tileSize*tileSize*3*sizeof(float);
+        }
+        return ret;
+    }
+    [[nodiscard]] TextureCache::Tile read(const Level& level,const std::uint32_t& column,const std::uint32_t& row)const{
+        TextureCache::Tile ret(std::size_t(tileSize)*tileSize*3);
+        const auto offset=static_cast<std::int64_t>(level.offset+(std::uint64_t(row)*level.columns+column)*tileBytes());
+#if defined(__unix__)||defined(__APPLE__)
+        if(::pread(fd,ret.data(),tileBytes(),offset)!=static_cast<ssize_t>(tileBytes()))
+            std::ranges::fill(ret,0.f);
+#else
+        std::ifstream in(file,std::ios::binary);
+        if(!in.seekg(offset).read(reinterpret_cast<char*>(ret.data()),static_cast<std::streamsize>(tileBytes())))
+            std::ranges::fill(ret,0.f);
+#endif
+        return ret;
+    }
+    [[nodiscard]] Color texel(const std::size_t& l,std::int64_t x,std::int64_t y)const{
+        const Level& level=levels[l];
+        x=(x%level.width+level.width)%level.width,y=(y%level.height+level.height)%level.height;
+        const auto column=static_cast<std::uint32_t>(x/tileSize),row=static_cast<std::uint32_t>(y/tileSize);
+        const auto tile=cache->get({id,static_cast<std::uint32_t>(l),row,column},[&]{return read(level,column,row);});
+        const float* p=tile->data()+((y%tileSize)*tileSize+x%tileSize)*3;
+        return{p[0],p[1],p[2]};
+    }
+    [[nodiscard]] Color bilinear(const std::size_t& l,const double& u,const double& v)const{
+        const double x=u*levels[l].width-0.5,y=v*levels[l].height-0.5,fx=std::floor(x),fy=std::floor(y),tx=x-fx,ty=y-fy;
+        const auto ix=static_cast<std::int64_t>(fx),iy=static_cast<std::int64_t>(fy);
+        return (texel(l,ix,iy)*(1-tx)+texel(l,ix+1,iy)*tx)*(1-ty)+(texel(l,ix,iy+1)*(1-tx)+texel(l,ix+1,iy+1)*tx)*ty;
+    }
+    TiledTexture(std::filesystem::path file,std::shared_ptr<TextureCache> cache):file(std::move(file)),cache(std::move(cache)),id(this->cache->identify()),tileSize(0){}
+public:
+    TiledTexture(const TiledTexture&)=delete;
+    TiledTexture& operator=(const TiledTexture&)=delete;
+    ~TiledTexture()override{
+#if defined(__unix__)||defined(__APPLE__)
+        if(fd>=0)
+            ::close(fd);
+#endif
+    }
+    ///Also count the TextureCache, once for all textures sharing it, with the cached tiles of all of them.
+    void memory(MemoryUsage& usage)const override{
+        if(!usage.first(this))
+            return;
+        usage.materials+=sizeof(TiledTexture),usage.overhead+=MemoryUsage::CONTROL+sizeof(void*)+2*MemoryUsage::BLOCK,usage.add(usage.materials,levels);
+        cache->memory(usage);
+    }
+    [[nodiscard]] std::uint32_t width()const{return levels[0].width;}
+    [[nodiscard]] std::uint32_t height()const{return levels[0].height;}
+
+    /**
+     * Open a texture file written by write(). Only the header is read.
+     * @return The texture, or nullptr if the file is missing or malformed.
+     */
+    static std::shared_ptr<TiledTexture> open(const std::filesystem::path& file,std::shared_ptr<TextureCache> cache){
+        std::shared_ptr<TiledTexture> ret(new TiledTexture(file,std::move(cache)));
+        Header header{};
+        std::error_code error;
+        const std::uintmax_t size=std::filesystem::file_size(file,error);
+        if(error||!std::ifstream(file,std::ios::binary).read(reinterpret_cast<char*>(&header),sizeof(header))
+           ||std::memcmp(header.magic,MAGIC,sizeof(MAGIC))||!header.width||!header.height||!header.tileSize||!header.levels||header.levels>32)
+            return nullptr;
+        ret->tileSize=header.tileSize;
+        ret->levels=layout(header.width,header.height,header.tileSize,header.levels);
+        const Level& last=ret->levels.back();
+        if(size!=last.offset+std::uint64_t(last.columns)*((last.height+header.tileSize-1)/header.tileSize)*ret->tileBytes())
+            return nullptr;
+#if defined(__unix__)||defined(__APPLE__)
+        if((ret->fd=::open(file.c_str(),O_RDONLY))<0)
+            return nullptr;
+#endif
+        return ret;
+    }
+
+    /**
+     * Write an image of width*height pixels in row-major order as a texture file, with every mip level down to 1*1.
+     * @return true on success, otherwise false.
+     */
+    static bool write(const std::filesystem::path& file,std::uint32_t width,std::uint32_t height,std::vector<Color> pixels,const std::uint32_t& tileSize=64){
+        if(!width||!height||!tileSize||pixels.size()!=std::size_t(width)*height)
+            return false;
+        const auto count=static_cast<std::uint32_t>(std::bit_width(std::max(width,height)));
+        Header header{};
+        std::memcpy(header.magic,MAGIC,sizeof(MAGIC));
+        header.width=width,header.height=height,header.tileSize=tileSize,header.levels=count;
+        std::ofstream out(file,std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+        std::vector<float> tile(std::size_t(tileSize)*tileSize*3);
+        //A texel of a level covers from/to texels of the level above along an axis, up to 3 where from is odd,
+        //which are weighted by how much of them it covers, so that every level keeps the mean of the image.
+        const auto taps=[](const std::uint32_t& from,const std::uint32_t& to){
+            std::vector<std::array<std::pair<std::uint32_t,double>,3>> ret(to);
+            for(std::uint32_t i=0;i<to;++i){
+                const double a=static_cast<double>(i)*from/to,b=static_cast<double>(i+1)*from/to;
+                for(std::uint32_t t=0;t<3;++t){
+                    const std::uint32_t j=static_cast<std::uint32_t>(a)+t;
+                    ret[i][t]=j<from?std::pair{j,std::max(std::min<double>(j+1,b)-std::max<double>(j,a),0.)/(b-a)}:std::pair{0u,0.};
+                }
+            }
+            return ret;
+        };
+        for(const Level& level:layout(width,height,tileSize,count)){
+            if(level.offset!=sizeof(Header)){
+                std::vector<Color> next(std::size_t(level.width)*level.height,Color{0,0,0});
+                const auto columns=taps(width,level.width),rows=taps(height,level.height);
+                for(std::uint32_t y=0;y<level.height;++y)
+                    for(std::uint32_t x=0;x<level.width;++x)
+                        for(const auto& [sy,wy]:rows[y])
+                            for(const auto& [sx,wx]:columns[x])
+                                next[std::size_t(y)*level.width+x]+=pixels[std::size_t(sy)*width+sx]*(wx*wy);
+                pixels=std::move(next),width=level.width,height=level.height;
+            }
+            for(std::uint32_t row=0;row*tileSize<level.height;++row)
+                for(std::uint32_t column=0;column<level.columns;++column){
+                    for(std::uint32_t y=0;y<tileSize;++y)
+                        for(std::uint32_t x=0;x<tileSize;++x){
+                            const Color& c=pixels[std::size_t(std::min(row*tileSize+y,level.height-1))*level.width+std::min(column*tileSize+x,level.width-1)];
+                            float* p=tile.data()+(std::size_t(y)*tileSize+x)*3;
+                            p[0]=static_cast<float>(c.x),p[1]=static_cast<float>(c.y),p[2]=static_cast<float>(c.z);
+                        }
+                    out.write(reinterpret_cast<const char*>(tile.data()),static_cast<std::streamsize>(tile.size()*sizeof(float)));
+                }
+        }
+        return static_cast<bool>(out);
+    }
+    [[nodiscard]] Color color(const double& u,const double& v,const double& footprint)const override{
+        const double level=std::clamp(std::log2(std::max(footprint*std::max(width(),height()),1.)),0.,static_cast<double>(levels.size()-1));
+        const auto l=static_cast<std::size_t>(level);
+        const double t=level-static_cast<double>(l);
+        const double x=u-std::floor(u),y=v-std::floor(v);
+        return t>0?bilinear(l,x,y)*(1-t)+bilinear(l+1,x,y)*t:bilinear(l,x,y);
+    }
+};
+
+class Sphere final:public Hittable{
+public:
+    Vector center;
+    double radius;
+    std::shared_ptr<Light> light;
+    std::shared_ptr<Material> material;
+    ///Texture mapped by longitude and latitude, with v growing downwards.
+    std::shared_ptr<const Texture> texture;
+    [[nodiscard]] std::optional<HitRecord> hit(const Vector& origin,const Vector& ray,const Interval&interval)const override{
+        const Vector co=origin-center;
+        const double b=ray*co,d=b*b-normSq(co)+radius*radius;
+        if(d<0)
+            return std::nullopt;
+        const double sd=std::sqrt(d),min=std::max(interval.min,EPSILON);
+        double t=-b-sd;
+        if(t<min)
+            t+=sd*2;
+        if(t<min||t>interval.max)
+            return std::nullopt;
+        const Vector point=origin+ray*t,normal=(point-center).unitize();
+        return HitRecord{point,normal,light.get(),t,material.get(),this,std::atan2(normal.z,normal.x)/(2*PI)+0.5,std::acos(std::clamp(-normal.y,-1.,1.))/PI,1/(PI*radius),texture.get()};
+    }
+    [[nodiscard]] Aabb aabb()const override{return{{center.x-radius,center.x+radius},{center.y-radius,center.y+radius},{center.z-radius,center.z+radius}};}
+
+    ///Materials are counted by the size of Material, exact for the stateless ones of this library.
+    void memory(MemoryUsage& usage)const override{
+        usage.shared(usage.primitives,this,sizeof(Sphere));
+        usage.shared(usage.materials,light.get(),sizeof(Light));
+        usage.shared(usage.materials,material.get(),sizeof(Material));
+        if(texture)
+            texture->memory(usage);
+    }
+};
+
+inline void BvhTree::classify(){
+    spheres.resize(objects.size());
+    for(std::size_t i=0;i<objects.size();++i)
+        spheres[i]=dynamic_cast<const Sphere*>(objects[i].get())!=nullptr;
+}
+inline std::optional<HitRecord> BvhTree::hitObject(const std::uint32_t& j,const Vector& origin,const Vector& ray,const Interval& range)const{
+    return spheres[j]?static_cast<const Sphere&>(*objects[j]).hit(origin,ray,range):objects[j]->hit(origin,ray,range);
+}
+
+///Pinhole camera looking along direction, producing an image of width*height pixels.
+class Camera{
+public:
+    Vector position,direction,up;
+    ///Vertical field of view in radians.
+    double fov;
+    std::size_t width,height;
+
+    ///@return Unit direction of the ray through the continuous image point (x,y), with y pointing down.
+    [[nodiscard]] Vector ray(const double& x,const double& y)const{
+        const double h=std::tan(fov/2),w=h*static_cast<double>(width)/static_cast<double>(height);
+        const Vector forward=unit(direction),right=unit(forward&up),down=forward&right;
+        return unit(forward+right*((x*2/static_cast<double>(width)-1)*w)+down*((y*2/static_cast<double>(height)-1)*h));
+    }
+
+    /**
+     * Project a point onto the image, the inverse of ray().
+     * @return true and the continuous image point in (x,y) if the point is in front of the camera, otherwise false.
+     */
+    bool project(const Vector& point,double& x,double& y)const{
+        const double h=std::tan(fov/2),w=h*static_cast<double>(width)/static_cast<double>(height);
+        const Vector forward=unit(direction),right=unit(forward&up),down=forward&right,d=point-position;
+        const double z=d*forward;
+        if(z<=0)
+            return false;
+        x=(d*right/(z*w)+1)*static_cast<double>(width)/2,y=(d*down/(z*h)+1)*static_cast<double>(height)/2;
+        return true;
+    }
+
+    ///@return Density over solid angle of ray() producing unit direction ray at a uniformly random image point, 0 outside the image.
+    [[nodiscard]] double possibility(const Vector& ray)const{
+        double x,y;
+        const double c=ray*unit(direction),h=std::tan(fov/2),w=h*static_cast<double>(width)/static_cast<double>(height);
+        if(c<=0||!project(position+ray,x,y)||x<0||y<0||x>=static_cast<double>(width)||y>=static_cast<double>(height))
+            return 0;
+        return 1/(4*w*h*c*c*c);
+    }
+};
+
+/**
+ * Image accumulating samples in square tiles.
+ * Each tile owns its own allocation, made lazily by the first thread rendering it, so that it lives on the memory node of that thread.
+ */
+class Framebuffer{
+public:
+    struct Tile{
+        std::size_t x,y,width,height;
+        ///Number of samples accumulated per pixel.
+        std::uint32_t samples=0;
+        ///Sum of samples of each pixel in row-major order, empty until allocated.
+        std::vector<Color> sum;
+        ///Sum over pixels and samples of the squared sample luminance, accumulated only by adaptive budgeted rendering.
+        double squares=0;
+        void allocate(){if(sum.empty())sum.assign(width*height,Color{0,0,0});}
+    };
+    std::size_t width,height,tileSize;
+    ///Tiles in row-major order.
+    std::vector<Tile> tiles;
+    ///Sum of contributions splatted to each pixel in row-major order, empty until an Integrator splats.
+    std::vector<Color> splat;
+    ///Number of passes accumulated in splat.
+    std::uint32_t splatSamples=0;
+    ///Primitive first hit through the center of each pixel in row-major order, nullptr for none, empty unless RenderOptions::firstHits.
+    std::vector<const Hittable*> firstHits;
+    Framebuffer(const std::size_t& width,const std::size_t& height,const std::size_t& tileSize=32):width(width),height(height),tileSize(tileSize){
+        for(std::size_t y=0;y<height;y+=tileSize)
+            for(std::size_t x=0;x<width;x+=tileSize)
+                tiles.push_back({x,y,std::min(tileSize,width-x),std::min(tileSize,height-y),0,{},0});
+    }
+    [[nodiscard]] std::size_t tileIndex(const std::size_t& x,const std::size_t& y)const{return y/tileSize*((width+tileSize-1)/tileSize)+x/tileSize;}
+
+    ///@return Indices of the tiles overlapping the crop window [x0,x1)*[y0,y1), clipped to the image.
+    [[nodiscard]] std::vector<std::size_t> tilesIn(const std::size_t& x0,const std::size_t& y0,std::size_t x1,std::size_t y1)const{
+        std::vector<std::size_t> ret;
+        x1=std::min(x1,width),y1=std::min(y1,height);
+        if(x0>=x1||y0>=y1)
+            return ret;
+        for(std::size_t y=y0/tileSize*tileSize;y<y1;y+=tileSize)
+            for(std::size_t x=x0/tileSize*tileSize;x<x1;x+=tileSize)
+                ret.push_back(tileIndex(x,y));
+        return ret;
+    }
+
+    /**
+     * Find the tiles to render again after editing objects, as those with a pixel whose first hit satisfies affected, or next to one in another tile
+     * since samples are jittered within their pixels. Only objects seen directly are caught, so edits showing in reflections or changing
+     * the light falling elsewhere need affected to cover the objects they show on.
+     * @param affected Predicate on const Hittable*, never called with nullptr.
+     * @return Indices of the tiles in increasing order, all tiles if firstHits were not recorded.
+     */
+    template<typename F>[[nodiscard]] std::vector<std::size_t> dirtyTiles(const F& affected)const{
+        std::vector<std::size_t> ret;
+        for(std::size_t i=0;i<tiles.size();++i){
+            const Tile& tile=tiles[i];
+            bool dirty=firstHits.empty();
+            for(std::size_t y=tile.y?tile.y-1:0;y<std::min(tile.y+tile.height+1,height)&&!dirty;++y)
+                for(std::size_t x=tile.x?tile.x-1:0;x<std::min(tile.x+tile.width+1,width)&&!dirty;++x)
+                    dirty=firstHits[y*width+x]&&affected(firstHits[y*width+x]);
+            if(dirty)
+                ret.push_back(i);
+        }
+        return ret;
+    }
+
+    ///Discard the samples of the tiles in indices, so that they are rendered from scratch.
+    void clear(const std::vector<std::size_t>& indices){
+        for(const std::size_t& i:indices)
+            std::fill(tiles[i].sum.begin(),tiles[i].sum.end(),Color{0,0,0}),tiles[i].samples=0,tiles[i].squares=0;
+    }
+
+    ///@return Mean of the samples of pixel (x,y), black if there are none.
+    [[nodiscard]] Color pixel(const std::size_t& x,const std::size_t& y)const{
+        const Tile& tile=tiles[tileIndex(x,y)];
+        Color ret=tile.samples?tile.sum[(y-tile.y)*tile.width+x-tile.x]/tile.samples:Color{0,0,0};
+        if(splatSamples)
+            ret+=splat[y*width+x]/splatSamples;
+        return ret;
+    }
+    void memory(MemoryUsage& usage)const{
+        if(!usage.first(this))
+            return;
+        usage.add(usage.buffers,tiles),usage.add(usage.buffers,splat),usage.add(usage.buffers,firstHits);
+        for(const Tile& tile:tiles)
+            usage.add(usage.buffers,tile.sum);
+    }
+};
+
+enum class SplatMode{
+    ///Buffer splats in sparse blocks per thread, merged after each pass in an order independent of scheduling.
+    deterministic,
+    ///Add splats to the Framebuffer at once with atomic adds, in nondeterministic order.
+    atomic
+};
+
+///Receiver of contributions of samples to arbitrary pixels, owned by a single render thread.
+class Splatter{
+    friend class Renderer;
+    struct Block{
+        std::size_t index;
+        std::vector<Color> sum;
+    };
+    Framebuffer* framebuffer=nullptr;
+    SplatMode mode=SplatMode::deterministic;
+    std::size_t blocksPerRow=0;
+    std::unordered_map<std::size_t,std::size_t> lookup;
+    std::vector<Block> blocks;
+    std::vector<Block> take(){return lookup.clear(),std::exchange(blocks,{});}
+public:
+    ///Side length of the square blocks splats are buffered in.
+    static constexpr std::size_t BLOCK=16;
+
+    ///Add color to the pixel containing the continuous image point (x,y). Points outside the image are ignored.
+    void add(const double& x,const double& y,const Color& color){
+        if(!framebuffer||!(x>=0&&y>=0&&x<static_cast<double>(framebuffer->width)&&y<static_cast<double>(framebuffer->height)))
+            return;
+        const auto px=static_cast<std::size_t>(x),py=static_cast<std::size_t>(y);
+        if(mode==SplatMode::atomic){
+            Color& pixel=framebuffer->splat[py*framebuffer->width+px];
+            std::atomic_ref(pixel.x).fetch_add(color.x,std::memory_order_relaxed);
+            std::atomic_ref(pixel.y).fetch_add(color.y,std::memory_order_relaxed);
+            std::atomic_ref(pixel.z).fetch_add(color.z,std::memory_order_relaxed);
+            return;
+        }
+        const auto [it,inserted]=lookup.try_emplace(py/BLOCK*blocksPerRow+px/BLOCK,blocks.size());
+        if(inserted)
+            blocks.push_back({it->first,std::vector<Color>(BLOCK*BLOCK,Color{0,0,0})});
+        blocks[it->second].sum[py%BLOCK*BLOCK+px%BLOCK]+=color;
+    }
+};
+
+/**
+ * High dynamic range environment in latitude-longitude layout, lighting the rays that leave the scene.
+ * Pixel (x,y) covers longitude u=(x+0.5)/width and colatitude v=(y+0.5)/height measured from +y, with u=0.5 along +x like Sphere.
+ * Directions are importance sampled by a marginal distribution over rows and a conditional one within each row, in proportion to luminance times the sine of the colatitude.
+ */
+class EnvironmentMap{
+    std::vector<double> marginal,conditional;
+    [[nodiscard]] std::size_t index(const Vector& direction)const{
+        const double u=std::atan2(direction.z,direction.x)/(2*PI)+0.5,v=std::acos(std::clamp(direction.y,-1.,1.))/PI;
+        const auto x=std::min(static_cast<std::size_t>(u*static_cast<double>(width)),width-1),y=std::min(static_cast<std::size_t>(v*static_cast<double>(height)),height-1);
+        return y*width+x;
+    }
+public:
+    std::size_t width,height;
+    ///Rows from top to bottom.
+    std::vector<Color> pixels;
+
+    ///Build the sampling distributions, in parallel over rows.
+    EnvironmentMap(const std::size_t& width,const std::size_t& height,std::vector<Color> pixels,const std::size_t& threads=0):marginal(height+1),conditional(height*(width+1)),width(width),height(height),pixels(std::move(pixels)){
+        parallelFor(height,[&](const std::size_t& y){
+            const double sin=std::sin(PI*(static_cast<double>(y)+0.5)/static_cast<double>(height));
+            double* cdf=conditional.data()+y*(width+1);
+            cdf[0]=0;
+            for(std::size_t x=0;x<width;++x)
+                cdf[x+1]=cdf[x]+std::max(luminance(this->pixels[y*width+x]),0.)*sin;
+        },threads);
+        for(std::size_t y=0;y<height;++y)
+            marginal[y+1]=marginal[y]+conditional[y*(width+1)+width];
+    }
+
+    /**
+     * Load a portable float map, either RGB (PF) or grayscale (Pf).
+     * @return The environment, or nullptr if the file is missing or malformed.
+     */
+    static std::shared_ptr<EnvironmentMap> load(const std::filesystem::path& file,const std::size_t& threads=0){
+        std::ifstream in(file,std::ios::binary);
+        std::string type;
+        std::size_t width=0,height=0;
+        double scale=0;
+        if(!(in>>type>>width>>height>>scale)||(type!="PF"&&type!="Pf")||!width||!height||!scale||!std::isfinite(scale))
+            return nullptr;
+        in.get();
+        const std::size_t channels=type=="PF"?3:1;
+        std::vector<std::uint32_t> data(width*height*channels);
+        if(!in.read(reinterpret_cast<char*>(data.data()),static_cast<std::streamsize>(data.size()*sizeof(std::uint32_t))))
+            return nullptr;
+        const bool swap=(scale<0)!=(std::endian::native==std::endian::little);
+        std::vector<Color> pixels(width*height);
+        for(std::size_t y=0;y<height;++y)
+            for(std::size_t x=0;x<width;++x){
+                double c[3];
+                for(std::size_t i=0;i<3;++i){
+                    std::uint32_t bits=data[(y*width+x)*channels+i%channels];
+                    if(swap)
+                        bits=bits>>24|(bits>>8&0xff00)|(bits<<8&0xff0000)|bits<<24;
+                    c[i]=std::bit_cast<float>(bits);
+                }
+                pixels[(height-1-y)*width+x]={c[0],c[1],c[2]};
+            }
+        return std::make_shared<EnvironmentMap>(width,height,std::move(pixels),threads);
+    }
+
+    ///@return Radiance arriving from unit direction.
+    [[nodiscard]] Color radiance(const Vector& direction)const{return pixels[index(direction)];}
+
+    ///@return Density over solid angle of sample() producing unit direction.
+    [[nodiscard]] double possibility(const Vector& direction)const{
+        const std::size_t i=index(direction),x=i%width,y=i/width;
+        const double sin=std::sqrt(std::max(1-direction.y*direction.y,0.)),f=conditional[y*(width+1)+x+1]-conditional[y*(width+1)+x];
+        return marginal.back()>0&&sin>0?f*static_cast<double>(width*height)/(marginal.back()*2*PI*PI*sin):0;
+    }
+
+    ///Sample a unit direction in proportion to the radiance, with its density over solid angle. Sampling fails with a density of 0 if the map is black.
+    [[nodiscard]] Vector sample(Generator& generator,double& possibility)const{
+        std::uniform_real_distribution<> d(0,1);
+        if(!(marginal.back()>0))
+            return possibility=0,Vector{0,1,0};
+        const auto pick=[&](const double* begin,const double* end){
+            const double target=d(generator)*end[-1];
+            const double* i=std::min(std::upper_bound(begin+1,end,target),end-1);
+            return static_cast<std::size_t>(i-begin-1);
+        };
+        const std::size_t y=pick(marginal.data(),marginal.data()+height+1),x=pick(conditional.data()+y*(width+1),conditional.data()+(y+1)*(width+1));
+        const double u=(static_cast<double>(x)+d(generator))/static_cast<double>(width),
+                     v=(static_cast<double>(y)+d(generator))/static_cast<double>(height),
+                     l=(u-0.5)*2*PI,sin=std::sin(v*PI);
+        const Vector ret{std::cos(l)*sin,std::cos(v*PI),std::sin(l)*sin};
+        possibility=this->possibility(ret);
+        return ret;
+    }
+};
+
+///Estimator of the radiance carried by camera rays.
+class Integrator{
+public:
+    virtual ~Integrator()=0;
+    [[nodiscard]] virtual Color radiance(const Hittable& scene,const Vector& origin,const Vector& ray,Generator& generator)const=0;
+
+    ///Called by Renderer before each pass, for integrators that precompute or learn between passes.
+    virtual void prepare(const Hittable& scene){}
+
+    ///@return true if sample() splats, so that the Renderer has to provide a Splatter.
+    [[nodiscard]] virtual bool splats()const{return false;}
+
+    /**
+     * Estimate the pixel sample at the continuous image point (x,y), possibly splatting contributions to other pixels.
+     * @return Contribution to the sampled pixel itself, by default radiance() of the camera ray.
+     */
+    [[nodiscard]] virtual Color sample(const Hittable& scene,const Camera& camera,const double& x,const double& y,Generator& generator,Splatter&)const{
+        return radiance(scene,camera.position,camera.ray(x,y),generator);
+    }
+
+    /**
+     * Add one sample of every pixel of an allocated tile to its sums, by default sample() at a random point of each pixel in row-major order.
+     * Integrators working on many paths at once override it.
+     */
+    virtual void sampleTile(const Hittable& scene,const Camera& camera,Framebuffer::Tile& tile,Generator& generator,Splatter& splatter)const{
+        std::uniform_real_distribution<> d(0,1);
+        for(std::size_t y=0;y<tile.height;++y)
+            for(std::size_t x=0;x<tile.width;++x){
+                const double px=static_cast<double>(tile.x+x)+d(generator),py=static_cast<double>(tile.y+y)+d(generator);
+                tile.sum[y*tile.width+x]+=sample(scene,camera,px,py,generator,splatter);
+            }
+    }
+};
+inline Integrator::~Integrator()=default;
+
+/**
+ * Sparse world-space grid caching the radiance scattered by non-specular surfaces, assuming it does not depend on the viewing direction.
+ * Cells are keyed by position and the dominant axis of the normal, in a fixed-size open-addressing table that threads update without locks.
+ * A cell accumulates estimates until it is reliable, after which its mean is reused.
+ */
+class RadianceCache{
+public:
+    struct Cell{
+        std::atomic<std::uint64_t> key=0;
+        std::atomic<std::uint32_t> count=0;
+        Color sum{0,0,0};
+        double sumSq=0;
+    };
+private:
+    std::unique_ptr<Cell[]> cells;
+    std::size_t mask;
+    static constexpr std::size_t PROBES=16;
+public:
+    ///Side length of a cell in world units.
+    double cellSize=0.25;
+    ///Number of estimates a cell needs before it is reused.
+    std::uint32_t minSamples=16;
+    ///Maximum relative standard error of the mean luminance of a reused cell.
+    double maxError=0.25;
+
+    ///@param capacity Number of cells, rounded up to a power of 2.
+    explicit RadianceCache(const std::size_t& capacity=1<<20):mask(std::bit_ceil(std::max<std::size_t>(capacity,PROBES))-1){cells=std::make_unique<Cell[]>(mask+1);}
+
+    ///@return The cell of point on a surface with unit normal, or nullptr if the table is too full to hold it.
+    [[nodiscard]] Cell* find(const Vector& point,const Vector& normal)const{
+        const auto axis=static_cast<std::uint64_t>(std::abs(normal.x)>std::abs(normal.y)&&std::abs(normal.x)>std::abs(normal.z)?0:std::abs(normal.y)>std::abs(normal.z)?1:2);
+        const std::uint64_t direction=axis<<1|static_cast<std::uint64_t>(normal[axis]<0);
+        const auto cell=[&](const double& a){return static_cast<std::uint64_t>(static_cast<std::int64_t>(std::floor(a/cellSize)));};
+        std::uint64_t key=cell(point.x)*0x9e3779b97f4a7c15^cell(point.y)*0xc2b2ae3d27d4eb4f^cell(point.z)*0x165667b19e3779f9^direction;
+        key=(key^key>>30)*0xbf58476d1ce4e5b9,key=(key^key>>27)*0x94d049bb133111eb,key=(key^key>>31)|1;
+        for(std::size_t i=0;i<PROBES;++i){
+            Cell& cell=cells[(key+i)&mask];
+            std::uint64_t expected=cell.key.load(std::memory_order_acquire);
+            if(expected==key||(!expected&&(cell.key.compare_exchange_strong(expected,key,std::memory_order_acq_rel)||expected==key)))
+                return &cell;
+        }
+        return nullptr;
+    }
+
+    ///@return true and the mean of cell in radiance if the cell is reliable, otherwise false.
+    bool lookup(const Cell& cell,Color& radiance)const{
+        const std::uint32_t count=cell.count.load(std::memory_order_acquire);
+        if(count<std::max(minSamples,2u))
+            return false;
+        auto& c=const_cast<Cell&>(cell);
+        const Color sum{std::atomic_ref(c.sum.x).load(std::memory_order_relaxed),std::atomic_ref(c.sum.y).load(std::memory_order_relaxed),std::atomic_ref(c.sum.z).load(std::memory_order_relaxed)};
+        const double n=count,mean=luminance(sum)/n,variance=std::max(std::atomic_ref(c.sumSq).load(std::memory_order_relaxed)/n-mean*mean,0.);
+        if(!(std::sqrt(variance/n)<maxError*mean))
+            return false;
+        return radiance=sum/n,true;
+    }
+
+    ///Add an estimate of the radiance scattered in cell.
+    void record(Cell& cell,const Color& radiance)const{
+        const double l=luminance(radiance);
+        std::atomic_ref(cell.sum.x).fetch_add(radiance.x,std::memory_order_relaxed);
+        std::atomic_ref(cell.sum.y).fetch_add(radiance.y,std::memory_order_relaxed);
+        std::atomic_ref(cell.sum.z).fetch_add(radiance.z,std::memory_order_relaxed);
+        std::atomic_ref(cell.sumSq).fetch_add(l*l,std::memory_order_relaxed);
+        cell.count.fetch_add(1,std::memory_order_release);
+    }
+
+    ///Empty the cache, which must not be in use.
+    void clear(){
+        for(std::size_t i=0;i<=mask;++i)
+            cells[i].key.store(0,std::memory_order_relaxed),cells[i].count.store(0,std::memory_order_relaxed),cells[i].sum={0,0,0},cells[i].sumSq=0;
+    }
+};
+
+///Table sampling indices in proportion to fixed weights in constant time, by Vose's alias method.
+class AliasTable{
+    std::vector<double> probability,pmfs;
+    std::vector<std::uint32_t> alias;
+public:
+    AliasTable()=default;
+
+    ///Weights must be non-negative. They are treated as equal if they sum to 0.
+    explicit AliasTable(const std::vector<double>& weights):probability(weights.size()),pmfs(weights.size()),alias(weights.size()){
+        const double sum=std::accumulate(weights.begin(),weights.end(),0.);
+        const auto n=static_cast<double>(weights.size());
+        std::vector<std::uint32_t> small,large;
+        for(std::size_t i=0;i<weights.size();++i){
+            pmfs[i]=sum>0?weights[i]/sum:1/n;
+            probability[i]=pmfs[i]*n;
+            (probability[i]<1?small:large).push_back(static_cast<std::uint32_t>(i));
+        }
+        while(!small.empty()&&!large.empty()){
+            const std::uint32_t s=small.back(),l=large.back();
+            small.pop_back();
+            alias[s]=l;
+            if((probability[l]+=probability[s]-1)<1)
+                large.pop_back(),small.push_back(l);
+        }
+        for(const std::uint32_t& i:small)
+            probability[i]=1;
+        for(const std::uint32_t& i:large)
+            probability[i]=1;
+    }
+    [[nodiscard]] std::size_t size()const{return pmfs.size();}
+    [[nodiscard]] double pmf(const std::size_t& i)const{return pmfs[i];}
+
+    ///@return An index with probability pmf(index). The table must not be empty.
+    [[nodiscard]] std::size_t sample(Generator& generator)const{
+        std::uniform_real_distribution<> d(0,1);
+        const double u=d(generator)*static_cast<double>(pmfs.size());
+        const std::size_t i=std::min(static_cast<std::size_t>(u),pmfs.size()-1);
+        return u-static_cast<double>(i)<probability[i]?i:alias[i];
+    }
+};
+
+///Emissive spheres among the objects of a scene, chosen in proportion to their power.
+class Emitters{
+    std::unordered_map<const Hittable*,std::size_t> index;
+public:
+    std::vector<std::shared_ptr<const Sphere>> spheres;
+    AliasTable table;
+    explicit Emitters(const std::vector<std::shared_ptr<const Hittable>>& objects){
+        std::vector<double> powers;
+        for(const auto& object:objects)
+            if(auto sphere=std::dynamic_pointer_cast<const Sphere>(object);sphere&&sphere->light)
+                index.emplace(sphere.get(),spheres.size()),spheres.push_back(std::move(sphere));
+        for(const auto& sphere:spheres)
+            powers.push_back(power(*sphere));
+        table=AliasTable(powers);
+    }
+    struct Sample{
+        Vector point,normal;
+        const Sphere* sphere;
+        ///Density of the point over the area of all emitters.
+        double possibility;
+    };
+
+    ///@return Power emitted by sphere, up to a constant factor.
+    [[nodiscard]] static double power(const Sphere& sphere){return luminance(sphere.light->color)*sphere.light->brightness*sphere.radius*sphere.radius;}
+
+    ///@return Index of object among spheres, or spheres.size() if it is not an emitter.
+    [[nodiscard]] std::size_t find(const Hittable* object)const{
+        const auto it=index.find(object);
+        return it==index.end()?spheres.size():it->second;
+    }
+
+    ///Sample a point by choosing an emitter from table and a point on it uniformly. There must be at least one emitter.
+    [[nodiscard]] Sample sample(Generator& generator)const{
+        const Sphere& sphere=*spheres[table.sample(generator)];
+        const Vector normal=RandUnitVec3(generator);
+        return{sphere.center+normal*sphere.radius,normal,&sphere,possibility(&sphere)};
+    }
+
+    ///@return Density of sample() returning a point on object, 0 if it is not an emitter.
+    [[nodiscard]] double possibility(const Hittable* object)const{
+        const std::size_t i=find(object);
+        return i==spheres.size()?0:table.pmf(i)/(4*PI*spheres[i]->radius*spheres[i]->radius);
+    }
+};
+
+/**
+ * Hierarchy over Emitters choosing one in proportion to an estimate of its contribution to a shading point, in logarithmic time.
+ * Nodes bound the position, emitted power, and orientation of their emitters, the last as a cone of normals widened by the spread of emission around them.
+ * Emitters are chosen from their alias table instead when there are few of them.
+ */
+class LightTree{
+public:
+    ///Node flattened like BvhNode, a leaf holding the single emitter at offset.
+    struct Node{
+        Aabb aabb;
+        Vector axis;
+        ///Cosines of the half angle of the cone of normals and of the spread of emission around a normal.
+        double cosNormal,cosEmission;
+        double power;
+        std::uint32_t offset,count;
+
+        ///@return Upper estimate of the contribution to a point with oriented normal n, which is ignored if zero.
+        [[nodiscard]] double importance(const Vector& point,const Vector& n)const{
+            const auto cosSub=[](const double& sinA,const double& cosA,const double& sinB,const double& cosB){return cosA>cosB?1:cosA*cosB+sinA*sinB;};
+            const auto sinSub=[](const double& sinA,const double& cosA,const double& sinB,const double& cosB){return cosA>cosB?0:sinA*cosB-cosA*sinB;};
+            const auto sinOf=[](const double& cos){return std::sqrt(std::max(1-cos*cos,0.));};
+            const Vector center=aabb.center(),d=point-center;
+            const double radiusSq=normSq(Vector{aabb.x.length(),aabb.y.length(),aabb.z.length()})/4,distSq=normSq(d);
+            if(distSq<=radiusSq)
+                return power/std::max(distSq,radiusSq/4);
+            const Vector wi=d/std::sqrt(distSq);
+            const double cosBound=std::sqrt(1-radiusSq/distSq),sinBound=sinOf(cosBound),
+                         cosW=std::clamp(axis*wi,-1.,1.),cosX=cosSub(sinOf(cosW),cosW,sinOf(cosNormal),cosNormal),sinX=sinSub(sinOf(cosW),cosW,sinOf(cosNormal),cosNormal),
+                         cosP=cosSub(sinX,cosX,sinBound,cosBound);
+            if(cosP<=cosEmission)
+                return 0;
+            double ret=power*cosP/distSq;
+            if(normSq(n)>0){
+                const double cosI=std::clamp(-(wi*n),-1.,1.);
+                ret*=std::max(cosSub(sinOf(cosI),cosI,sinBound,cosBound),0.);
+            }
+            return ret;
+        }
+    };
+private:
+    std::vector<std::uint64_t> trails;
+    std::uint32_t build(std::vector<std::uint32_t>& indices,const std::uint32_t& begin,const std::uint32_t& end,const std::uint64_t& trail,const std::uint32_t& depth){
+        const auto index=static_cast<std::uint32_t>(nodes.size());
+        if(end-begin==1){
+            const Sphere& sphere=*emitters.spheres[indices[begin]];
+            trails[indices[begin]]=trail;
+            nodes.push_back({sphere.aabb(),{0,0,1},-1,0,Emitters::power(sphere),indices[begin],1});
+            return index;
+        }
+        Aabb centers=Aabb::empty;
+        for(std::uint32_t i=begin;i<end;++i)
+            centers.unite(Aabb(emitters.spheres[indices[i]]->center,emitters.spheres[indices[i]]->center));
+        const std::size_t axis=centers.longestAxis();
+        const std::uint32_t mid=begin+(end-begin)/2;
+        std::nth_element(indices.begin()+begin,indices.begin()+mid,indices.begin()+end,[&](const std::uint32_t& a,const std::uint32_t& b){
+            return emitters.spheres[a]->center[axis]<emitters.spheres[b]->center[axis];
+        });
+        nodes.emplace_back();
+        build(indices,begin,mid,trail,depth+1);
+        const std::uint32_t right=build(indices,mid,end,trail|std::uint64_t(1)<<depth,depth+1);
+        const Node& a=nodes[index+1];
+        const Node& b=nodes[right];
+        nodes[index]={Aabb(a.aabb,b.aabb),{0,0,0},0,std::min(a.cosEmission,b.cosEmission),a.power+b.power,right,0};
+        unite(nodes[index],a,b);
+        return index;
+    }
+
+    ///Bound the cones of normals of a and b by the cone of node.
+    static void unite(Node& node,const Node& a,const Node& b){
+        if(a.cosNormal<b.cosNormal)
+            return unite(node,b,a);
+        const double thetaA=std::acos(std::clamp(a.cosNormal,-1.,1.)),thetaB=std::acos(std::clamp(b.cosNormal,-1.,1.)),
+                     thetaD=std::acos(std::clamp(a.axis*b.axis,-1.,1.));
+        if(std::min(thetaD+thetaB,PI)<=thetaA)
+            return node.axis=a.axis,node.cosNormal=a.cosNormal,void();
+        const double theta=(thetaA+thetaD+thetaB)/2;
+        if(theta>=PI)
+            return node.axis=a.axis,node.cosNormal=-1,void();
+        const Vector w=a.axis&b.axis;
+        if(normSq(w)<EPSILON*EPSILON)
+            return node.axis=a.axis,node.cosNormal=-1,void();
+        const double rotation=theta-thetaA,c=std::cos(rotation),s=std::sin(rotation);
+        const Vector k=unit(w);
+        node.axis=unit(a.axis*c+(k&a.axis)*s+k*(k*a.axis)*(1-c)),node.cosNormal=std::cos(theta);
+    }
+public:
+    Emitters emitters;
+    std::vector<Node> nodes;
+    ///Number of emitters up to which they are chosen from the alias table of emitters regardless of the shading point.
+    std::size_t threshold=8;
+    explicit LightTree(Emitters emitters):trails(emitters.spheres.size()),emitters(std::move(emitters)){
+        if(this->emitters.spheres.empty())
+            return;
+        std::vector<std::uint32_t> indices(this->emitters.spheres.size());
+        std::iota(indices.begin(),indices.end(),0u);
+        build(indices,0,static_cast<std::uint32_t>(indices.size()),0,0);
+    }
+
+    /**
+     * Choose an emitter for a point with oriented normal n, or a zero normal if there is no surface.
+     * @return Index of the emitter among emitters.spheres with its probability in pmf, or emitters.spheres.size() if none can contribute.
+     */
+    [[nodiscard]] std::size_t sample(const Vector& point,const Vector& n,Generator& generator,double& pmf)const{
+        if(emitters.spheres.size()<=threshold){
+            if(emitters.spheres.empty())
+                return pmf=0,0;
+            const std::size_t ret=emitters.table.sample(generator);
+            return pmf=emitters.table.pmf(ret),ret;
+        }
+        std::uniform_real_distribution<> d(0,1);
+        pmf=1;
+        std::uint32_t i=0;
+        while(!nodes[i].count){
+            const double left=nodes[i+1].importance(point,n),right=nodes[nodes[i].offset].importance(point,n);
+            if(!(left+right>0))
+                return pmf=0,emitters.spheres.size();
+            const double p=left/(left+right);
+            if(d(generator)<p)
+                pmf*=p,++i;
+            else
+                pmf*=1-p,i=nodes[i].offset;
+        }
+        return nodes[i].offset;
+    }
+
+    ///@return Probability of sample() choosing emitter i for a point with oriented normal n.
+    [[nodiscard]] double pmf(const Vector& point,const Vector& n,const std::size_t& i)const{
+        if(emitters.spheres.size()<=threshold)
+            return emitters.table.pmf(i);
+        double ret=1;
+        std::uint64_t trail=trails[i];
+        for(std::uint32_t node=0;!nodes[node].count;trail>>=1){
+            const double left=nodes[node+1].importance(point,n),right=nodes[nodes[node].offset].importance(point,n);
+            if(!(left+right>0))
+                return 0;
+            ret*=(trail&1?right:left)/(left+right);
+            node=trail&1?nodes[node].offset:node+1;
+        }
+        return ret;
+    }
+};
+
+/**
+ * Unidirectional path tracer sampling Material::generate at every bounce and collecting Light on hit.
+ * With a RadianceCache, non-specular vertices after the first bounce reuse and update it.
+ */
+class PathTracer final:public Integrator{
+public:
+    std::size_t depth=8;
+    Color background{0,0,0};
+    std::shared_ptr<RadianceCache> cache;
+    ///Environment replacing background, sampled at every non-specular vertex and weighted against Material::generate by the power heuristic.
+    std::shared_ptr<const EnvironmentMap> environment;
+    ///Emitters sampled at every non-specular vertex and weighted against Material::generate by the power heuristic.
+    std::shared_ptr<const LightTree> lights;
+    /**
+     * Angle between the camera rays of adjacent pixels, the initial spread of a ray cone whose width is the footprint of texture lookups.
+     * Non-specular bounces widen the spread to at least one radian.
+     */
+    double spread=0;
+    [[nodiscard]] Color radiance(const Hittable& scene,const Vector& origin,const Vector& ray,Generator& generator)const override{
+        thread_local std::vector<std::tuple<RadianceCache::Cell*,Color,Color>> pending;
+        Color ret{0,0,0},beta{1,1,1};
+        Vector o=origin,r=ray,m{0,0,0};
+        double width=0,angle=spread,last=0;
+        const auto heuristic=[](const double& a,const double& b){return a*a/(a*a+b*b);};
+        pending.clear(),pending.reserve(depth);
+        for(std::size_t i=0;i<depth;++i){
+            const auto record=scene.hit(o,r,{0,INF});
+            if(!record){
+                if(!environment)
+                    ret+=hadamard(beta,background);
+                else
+                    ret+=hadamard(beta,environment->radiance(r))*(last>0?heuristic(last,environment->possibility(r)):1);
+                break;
+            }
+            if(record->light){
+                double weight=1;
+                if(const std::size_t e=lights?lights->emitters.find(record->object):0;last>0&&lights&&e<lights->emitters.spheres.size()){
+                    const double radius=lights->emitters.spheres[e]->radius;
+                    weight=heuristic(last,lights->pmf(o,m,e)/(4*PI*radius*radius)*record->dist*record->dist/std::abs(r*record->normal));
+                }
+                ret+=hadamard(beta,record->light->color*record->light->brightness)*weight;
+            }
+            if(!record->material)
+                break;
+            const Vector n=r*record->normal<0?record->normal:-record->normal;
+            const bool specular=record->material->specular();
+            if(cache&&i&&!specular)
+                if(auto* cell=cache->find(record->point,n)){
+                    if(Color cached;cache->lookup(*cell,cached)){
+                        ret+=hadamard(beta,cached);
+                        break;
+                    }
+                    pending.emplace_back(cell,ret,beta);
+                }
+            width+=angle*record->dist;
+            beta=hadamard(beta,record->albedo(width));
+            const Vector theoretic=reflect(r,n);
+            o=record->point;
+            if(!specular){
+                angle=std::max(angle,1.);
+                if(double pdf;environment)
+                    if(const Vector l=environment->sample(generator,pdf);pdf>0&&l*n>0&&!scene.hit(o,l,{0,INF}))
+                        if(const double f=record->material->possibility(theoretic,l);f>0)
+                            ret+=hadamard(beta,environment->radiance(l))*(f/pdf*heuristic(pdf,f));
+                if(double pmf;lights)
+                    if(const std::size_t e=lights->sample(o,n,generator,pmf);pmf>0){
+                        const Sphere& sphere=*lights->emitters.spheres[e];
+                        const Vector normal=RandUnitVec3(generator),d=sphere.center+normal*sphere.radius-o;
+                        const double dist=norm(d);
+                        const Vector l=d/dist;
+                        const double cos=-(l*normal),f=record->material->possibility(theoretic,l);
+                        if(cos>0&&l*n>0&&f>0&&!scene.hit(o,l,{0,dist*(1-1e-6)})){
+                            const double pdf=pmf/(4*PI*sphere.radius*sphere.radius)*dist*dist/cos;
+                            ret+=hadamard(beta,sphere.light->color*sphere.light->brightness)*(f/pdf*heuristic(pdf,f));
+                        }
+                    }
+            }
+            m=n;
+            r=record->material->generate(n,theoretic);
+            last=specular?0:record->material->possibility(theoretic,r);
+        }
+        for(const auto& [cell,before,b]:pending)
+            if(b.x>0&&b.y>0&&b.z>0)
+                cache->record(*cell,{(ret.x-before.x)/b.x,(ret.y-before.y)/b.y,(ret.z-before.z)/b.z});
+        return ret;
+    }
+};
+
+/**
+ * Path tracer like PathTracer without its options, advancing all paths of a tile one bounce at a time.
+ * Before tracing a bounce, the queued secondary rays are sorted in batches by the octant of their direction and then the Morton code of their origin,
+ * so that consecutive rays tend to visit the same BVH nodes.
+ */
+class WavefrontPathTracer final:public Integrator{
+public:
+    struct Ray{
+        Vector origin,direction;
+        Color beta;
+        ///Index of the pixel in the tile.
+        std::uint32_t pixel;
+    };
+    std::size_t depth=8;
+    Color background{0,0,0};
+    /**
+     * Sort secondary rays before tracing them. Off by default: on small scenes whose BVH fits in cache the sort costs more than it saves.
+     * Worth enabling for scenes with many more nodes than the cache holds, where coherent rays share node fetches; measure before relying on it.
+     */
+    bool sorting=false;
+    ///Number of consecutive queued rays sorted together. Larger batches are more coherent but cost more to sort.
+    std::size_t batchSize=4096;
+    [[nodiscard]] Color radiance(const Hittable& scene,const Vector& origin,const Vector& ray,Generator& generator)const override{
+        Color ret{0,0,0};
+        thread_local std::vector<Ray> queue,next;
+        queue.assign(1,{origin,ray,{1,1,1},0});
+        for(std::size_t i=0;i<depth&&!queue.empty();++i)
+            trace(scene,queue,next,&ret,generator),queue.swap(next);
+        return ret;
+    }
+
+    /**
+     * Trace every ray of queue, adding collected light to the sums of their pixels and queueing the scattered rays in next, in the same order.
+     * Hits are sorted by Material and gathered into structure of arrays batches, and every run of one Material is shaded at once by Material::generateBatch.
+     */
+    void trace(const Hittable& scene,const std::vector<Ray>& queue,std::vector<Ray>& next,Color* sums,Generator& generator)const{
+        thread_local std::vector<const Material*> materials;
+        thread_local std::vector<std::uint32_t> order;
+        thread_local std::vector<Vector> normals,theoretics;
+        thread_local VectorArray batchNormals,batchTheoretics,out;
+        thread_local std::vector<double> u,v,batchU,batchV,possibilities;
+        std::uniform_real_distribution<> d(0,1);
+        next.clear(),materials.clear(),normals.clear(),theoretics.clear(),u.clear(),v.clear();
+        //At most every ray of queue scatters, so the buffers stop growing once the queue does.
+        normals.reserve(queue.size()),theoretics.reserve(queue.size());
+        for(auto* buffer:{&batchNormals,&batchTheoretics,&out})
+            buffer->reserve(queue.size());
+        for(auto* buffer:{&u,&v,&batchU,&batchV,&possibilities})
+            buffer->reserve(queue.size());
+        materials.reserve(queue.size()),order.reserve(queue.size());
+        for(const Ray& ray:queue){
+            const auto record=scene.hit(ray.origin,ray.direction,{0,INF});
+            if(!record){
+                sums[ray.pixel]+=hadamard(ray.beta,background);
+                continue;
+            }
+            if(record->light)
+                sums[ray.pixel]+=hadamard(ray.beta,record->light->color*record->light->brightness);
+            if(!record->material)
+                continue;
+            const Vector n=ray.direction*record->normal<0?record->normal:-record->normal;
+            materials.push_back(record->material),normals.push_back(n),theoretics.push_back(reflect(ray.direction,n));
+            u.push_back(d(generator)),v.push_back(d(generator));
+            next.push_back({record->point,{},hadamard(ray.beta,record->albedo()),ray.pixel});
+        }
+        const std::size_t count=next.size();
+        order.resize(count),batchNormals.resize(count),batchTheoretics.resize(count),batchU.resize(count),batchV.resize(count),out.resize(count),possibilities.resize(count);
+        std::iota(order.begin(),order.end(),0);
+        std::sort(order.begin(),order.end(),[&](const std::uint32_t& a,const std::uint32_t& b){
+            return materials[a]!=materials[b]?std::less<const Material*>()(materials[a],materials[b]):a<b;
+        });
+        for(std::size_t i=0;i<count;++i){
+            const std::uint32_t j=order[i];
+            batchNormals.data().set(i,normals[j]),batchTheoretics.data().set(i,theoretics[j]),batchU[i]=u[j],batchV[i]=v[j];
+        }
+        for(std::size_t begin=0,end;begin<count;begin=end){
+            const Material* material=materials[order[begin]];
+            for(end=begin+1;end<count&&materials[order[end]]==material;++end);
+            material->generateBatch(end-begin,batchNormals.data()+begin,batchTheoretics.data()+begin,batchU.data()+begin,batchV.data()+begin,out.data()+begin,possibilities.data()+begin);
+        }
+        for(std::size_t i=0;i<count;++i)
+            next[order[i]].direction=out.data()[i];
+    }
+
+    ///Sort rays in consecutive batches of batchSize by direction octant, then by the Morton code of the origin within bounds.
+    void sort(std::vector<Ray>& rays,const Aabb& bounds)const{
+        thread_local std::vector<std::uint64_t> keys;
+        thread_local std::vector<std::uint32_t> order;
+        thread_local std::vector<Ray> sorted;
+        thread_local RadixScratch scratch;
+        //Sized for the capacity of rays rather than its size, since sorted and rays trade buffers.
+        const std::size_t batch=std::min(rays.capacity(),std::max<std::size_t>(batchSize,1));
+        sorted.reserve(rays.capacity()),keys.reserve(batch),order.reserve(batch),scratch.keys.reserve(batch),scratch.values.reserve(batch);
+        sorted.resize(rays.size());
+        for(std::size_t begin=0,size=std::max<std::size_t>(batchSize,1);begin<rays.size();begin+=size){
+            const std::size_t end=std::min(rays.size(),begin+size);
+            keys.resize(end-begin),order.resize(end-begin);
+            for(std::size_t i=begin;i<end;++i){
+                const Vector& d=rays[i].direction;
+                keys[i-begin]=std::uint64_t((d.x<0)|(d.y<0)<<1|(d.z<0)<<2)<<30|morton(rays[i].origin,bounds,30);
+                order[i-begin]=static_cast<std::uint32_t>(i);
+            }
+            radixSort(keys,order,33,1,scratch);
+            for(std::size_t i=begin;i<end;++i)
+                sorted[i]=rays[order[i-begin]];
+        }
+        rays.swap(sorted);
+    }
+    void sampleTile(const Hittable& scene,const Camera& camera,Framebuffer::Tile& tile,Generator& generator,Splatter&)const override{
+        thread_local std::vector<Ray> queue,next;
+        std::uniform_real_distribution<> d(0,1);
+        queue.clear(),queue.reserve(tile.width*tile.height),next.reserve(tile.width*tile.height);
+        for(std::size_t y=0;y<tile.height;++y)
+            for(std::size_t x=0;x<tile.width;++x){
+                const double px=static_cast<double>(tile.x+x)+d(generator),py=static_cast<double>(tile.y+y)+d(generator);
+                queue.push_back({camera.position,camera.ray(px,py),{1,1,1},static_cast<std::uint32_t>(y*tile.width+x)});
+            }
+        const Aabb bounds=scene.aabb();
+        for(std::size_t i=0;i<depth&&!queue.empty();++i){
+            if(sorting&&i)
+                sort(queue,bounds);
+            trace(scene,queue,next,tile.sum.data(),generator),queue.swap(next);
+        }
+    }
+};
+
+/**
+ * Bidirectional path tracer connecting every prefix of a camera path with every prefix of a light path from Emitters.
+ * Strategies are combined by multiple importance sampling with the power heuristic.
+ * Connections of light paths to the camera are splatted, so they are only made by sample().
+ */
+class BidirectionalPathTracer final:public Integrator{
+    enum class Type{camera,light,surface};
+    struct Vertex{
+        Type type;
+        Vector point,normal;
+        Color beta;
+        const Material* material=nullptr;
+        const Light* light=nullptr;
+        const Hittable* object=nullptr;
+        ///Densities of sampling this vertex from the camera and from the light side, over area.
+        double pdfFwd=0,pdfRev=0;
+        bool delta=false;
+        ///Texture color scattering at this vertex, which beta does not include yet.
+        Color albedo{1,1,1};
+    };
+    static double remap(const double& pdf){return pdf?pdf:1;}
+
+    /**
+     * @return Density over solid angle of scattering at v from direction in to out.
+     * As Material is lossless, this is also the scattering function times the cosine of out for light arriving from out and leaving against in.
+     * Since the scattering function need not be symmetric, light paths evaluate it through adjoint().
+     */
+    static double density(const Vertex& v,const Vector& in,const Vector& out){
+        if(!v.material||v.material->specular())
+            return 0;
+        const double cosIn=-(in*v.normal),cosOut=out*v.normal;
+        if(cosIn*cosOut<=0)
+            return 0;
+        const Vector n=cosIn>0?v.normal:-v.normal;
+        return v.material->possibility(reflect(in,n),out);
+    }
+
+    ///@return Scattering function at v times the cosine of out, for light arriving against in and leaving along out.
+    static double adjoint(const Vertex& v,const Vector& in,const Vector& out){
+        const double cosIn=std::abs(in*v.normal);
+        return cosIn?density(v,-out,-in)*std::abs(out*v.normal)/cosIn:0;
+    }
+
+    ///@return Density over the area at to of from scattering towards it, having been reached from prev.
+    [[nodiscard]] double pdf(const Vertex& from,const Vertex* prev,const Vertex& to,const Camera* camera)const{
+        const Vector d=to.point-from.point;
+        const double distSq=normSq(d);
+        const Vector w=d/std::sqrt(distSq);
+        double ret;
+        if(from.type==Type::camera)
+            ret=camera?camera->possibility(w):0;
+        else if(!prev)
+            ret=std::max(w*from.normal,0.)/PI;
+        else
+            ret=density(from,unit(from.point-prev->point),w);
+        return to.type==Type::camera?ret/distSq:ret*std::abs(w*to.normal)/distSq;
+    }
+    static bool visible(const Hittable& scene,const Vector& a,const Vector& b){
+        const Vector d=b-a;
+        const double dist=norm(d);
+        return !scene.hit(a,d/dist,{0,dist*(1-1e-7)});
+    }
+    ///Extend a camera or light path by sampling Material::generate, starting with throughput beta.
+    static void walk(const Hittable& scene,std::vector<Vertex>& path,Vector ray,Color beta,double pdfDir,const std::size_t& size,const bool& light){
+        while(path.size()<size){
+            const auto record=scene.hit(path.back().point,ray,{0,INF});
+            if(!record)
+                return;
+            Vertex v{Type::surface,record->point,record->normal,beta,record->material,record->light,record->object};
+            v.pdfFwd=pdfDir*std::abs(ray*v.normal)/(record->dist*record->dist);
+            v.albedo=record->albedo();
+            path.push_back(v);
+            if(!v.material)
+                return;
+            beta=hadamard(beta,v.albedo);
+            const Vector n=ray*v.normal<0?v.normal:-v.normal,next=v.material->generate(n,reflect(ray,n));
+            if(next*n<=0)
+                return;
+            double pdfRevDir=0;
+            if(v.material->specular())
+                path.back().delta=true,pdfDir=0;
+            else if((pdfDir=v.material->possibility(reflect(ray,n),next),pdfRevDir=v.material->possibility(reflect(-next,n),-ray)),pdfDir<=0)
+                return;
+            else if(light)
+                beta=beta*(pdfRevDir*(next*n)/(pdfDir*-(ray*n)));
+            Vertex& prev=path[path.size()-2];
+            prev.pdfRev=prev.type==Type::camera?0:pdfRevDir*std::abs(ray*prev.normal)/(record->dist*record->dist);
+            ray=next;
+        }
+    }
+    [[nodiscard]] double weight(const std::vector<Vertex>& lightPath,const std::vector<Vertex>& cameraPath,const Vertex& sampled,const std::size_t& s,const std::size_t& t,const Camera* camera)const{
+        thread_local std::vector<Vertex> y,z;
+        y.reserve(depth+1),z.reserve(depth+2);
+        y.assign(lightPath.begin(),lightPath.begin()+static_cast<std::ptrdiff_t>(s)),z.assign(cameraPath.begin(),cameraPath.begin()+static_cast<std::ptrdiff_t>(t));
+        if(s==1&&t>1)
+            y[0]=sampled;
+        Vertex* qs=s?&y[s-1]:nullptr,*qsPrev=s>1?&y[s-2]:nullptr,&pt=z[t-1],*ptPrev=t>1?&z[t-2]:nullptr;
+        pt.delta=false;
+        if(qs){
+            qs->delta=false;
+            pt.pdfRev=pdf(*qs,qsPrev,pt,camera);
+            if(ptPrev)
+                ptPrev->pdfRev=pdf(pt,qs,*ptPrev,camera);
+            qs->pdfRev=pdf(pt,ptPrev,*qs,camera);
+            if(qsPrev)
+                qsPrev->pdfRev=pdf(*qs,&pt,*qsPrev,camera);
+        }else{
+            pt.pdfRev=emitters.possibility(pt.object);
+            if(ptPrev){
+                Vertex light=pt;
+                light.type=Type::light;
+                ptPrev->pdfRev=pdf(light,nullptr,*ptPrev,camera);
+            }
+        }
+        double sum=0,ratio=1;
+        for(std::size_t i=t-1;i>0;--i){
+            ratio*=remap(z[i].pdfRev)/remap(z[i].pdfFwd);
+            if(!z[i].delta&&!z[i-1].delta&&(i>1||camera))
+                sum+=ratio*ratio;
+        }
+        ratio=1;
+        for(std::size_t i=s;i--;){
+            ratio*=remap(y[i].pdfRev)/remap(y[i].pdfFwd);
+            if(!y[i].delta&&!(i&&y[i-1].delta))
+                sum+=ratio*ratio;
+        }
+        return 1/(1+sum);
+    }
+    [[nodiscard]] Color trace(const Hittable& scene,const Vector& origin,const Vector& ray,Generator& generator,const Camera* camera,Splatter* splatter)const{
+        const auto lightVertex=[&](const Emitters::Sample& e)->Vertex{
+            const Light& light=*e.sphere->light;
+            return{Type::light,e.point,e.normal,light.color*(light.brightness/e.possibility),nullptr,&light,e.sphere,e.possibility};
+        };
+        thread_local std::vector<Vertex> cameraPath,lightPath;
+        cameraPath.reserve(depth+2),lightPath.reserve(depth+1);
+        cameraPath.assign(1,{Type::camera,origin,{0,0,0},{1,1,1}}),lightPath.clear();
+        walk(scene,cameraPath,ray,{1,1,1},camera?camera->possibility(ray):0,depth+2,false);
+        if(!emitters.spheres.empty()){
+            const auto e=emitters.sample(generator);
+            const Vector dir=RandCosineVec3OnUnitHemisphere(generator,e.normal);
+            lightPath.push_back(lightVertex(e));
+            walk(scene,lightPath,dir,lightPath.front().beta*PI,dir*e.normal/PI,depth+1,true);
+        }
+        Color ret{0,0,0};
+        for(std::size_t t=1;t<=cameraPath.size();++t)
+            for(std::size_t s=0;s<=lightPath.size();++s){
+                if(s+t<2||s+t-2>depth||(t==1&&!camera))
+                    continue;
+                const Vertex& pt=cameraPath[t-1];
+                Vertex sampled{};
+                Color l{0,0,0};
+                double x=0,y=0;
+                if(!s){
+                    if(!pt.light||(cameraPath[t-2].point-pt.point)*pt.normal<=0)
+                        continue;
+                    l=hadamard(pt.beta,pt.light->color*pt.light->brightness);
+                }else if(t==1){
+                    const Vertex& qs=lightPath[s-1];
+                    if(qs.delta||!camera->project(qs.point,x,y)||!visible(scene,qs.point,camera->position))
+                        continue;
+                    const Vector d=camera->position-qs.point;
+                    const double f=s==1?std::max(unit(d)*qs.normal,0.):adjoint(qs,unit(qs.point-lightPath[s-2].point),unit(d));
+                    l=hadamard(qs.beta,qs.albedo)*(f*camera->possibility(-unit(d))/normSq(d));
+                }else{
+                    if(s==1)
+                        sampled=lightVertex(emitters.sample(generator));
+                    const Vertex& qs=s==1?sampled:lightPath[s-1];
+                    if(qs.delta||pt.delta||!pt.material)
+                        continue;
+                    const Vector d=qs.point-pt.point;
+                    const Vector w=unit(d);
+                    const double fp=density(pt,unit(pt.point-cameraPath[t-2].point),w),
+                                 fq=s==1?std::max(-(w*qs.normal),0.):adjoint(qs,unit(qs.point-lightPath[s-2].point),-w);
+                    if(fp*fq<=0||!visible(scene,pt.point,qs.point))
+                        continue;
+                    l=hadamard(hadamard(qs.beta,qs.albedo),hadamard(pt.beta,pt.albedo))*(fp*fq/normSq(d));
+                }
+                l=l*weight(lightPath,cameraPath,sampled,s,t,camera);
+                if(t==1)
+                    splatter->add(x,y,l);
+                else
+                    ret+=l;
+            }
+        return ret;
+    }
+public:
+    Emitters emitters;
+    ///Maximum number of bounces of a path.
+    std::size_t depth=8;
+    explicit BidirectionalPathTracer(Emitters emitters):emitters(std::move(emitters)){}
+    [[nodiscard]] Color radiance(const Hittable& scene,const Vector& origin,const Vector& ray,Generator& generator)const override{
+        return trace(scene,origin,ray,generator,nullptr,nullptr);
+    }
+    [[nodiscard]] bool splats()const override{return true;}
+    [[nodiscard]] Color sample(const Hittable& scene,const Camera& camera,const double& x,const double& y,Generator& generator,Splatter& splatter)const override{
+        return trace(scene,camera.position,camera.ray(x,y),generator,&camera,&splatter);
+    }
+};
+
+/**
+ * Photons in a kd-tree laid out in a single array.
+ * Every subtree occupies a contiguous range with its root in the middle, so no child links are stored and queries walk memory mostly forward.
+ */
+class PhotonMap{
+public:
+    struct Photon{
+        Vector point;
+        ///Direction the photon travelled in.
+        Vector direction;
+        Color power;
+        ///Splitting axis of the subtree rooted at this photon.
+        std::uint8_t axis;
+    };
+private:
+    void build(const std::size_t& begin,const std::size_t& end){
+        if(end-begin<2)
+            return;
+        Aabb bounds=Aabb::empty;
+        for(std::size_t i=begin;i<end;++i)
+            bounds.unite({photons[i].point,photons[i].point});
+        const std::size_t axis=bounds.longestAxis(),middle=begin+(end-begin)/2;
+        std::nth_element(photons.begin()+static_cast<std::ptrdiff_t>(begin),photons.begin()+static_cast<std::ptrdiff_t>(middle),photons.begin()+static_cast<std::ptrdiff_t>(end),
+                         [&](const Photon& a,const Photon& b){return a.point[axis]<b.point[axis];});
+        photons[middle].axis=static_cast<std::uint8_t>(axis);
+        build(begin,middle),build(middle+1,end);
+    }
+    void search(const std::size_t& begin,const std::size_t& end,const Vector& point,const std::size_t& k,double& maxDistSq,std::vector<std::pair<double,const Photon*>>& heap)const{
+        if(begin>=end)
+            return;
+        const std::size_t middle=begin+(end-begin)/2;
+        const Photon& photon=photons[middle];
+        const double d=point[photon.axis]-photon.point[photon.axis];
+        if(end-begin>1){
+            if(d<0)
+                search(begin,middle,point,k,maxDistSq,heap);
+            else
+                search(middle+1,end,point,k,maxDistSq,heap);
+        }
+        if(const double distSq=normSq(photon.point-point);distSq<maxDistSq){
+            heap.emplace_back(distSq,&photon),std::ranges::push_heap(heap);
+            if(heap.size()>k)
+                std::ranges::pop_heap(heap),heap.pop_back();
+            if(heap.size()==k)
+                maxDistSq=heap.front().first;
+        }
+        if(end-begin>1&&d*d<maxDistSq){
+            if(d<0)
+                search(middle+1,end,point,k,maxDistSq,heap);
+            else
+                search(begin,middle,point,k,maxDistSq,heap);
+        }
+    }
+public:
+    std::vector<Photon> photons;
+    PhotonMap()=default;
+    explicit PhotonMap(std::vector<Photon> photons):photons(std::move(photons)){build(0,this->photons.size());}
+
+    /**
+     * Find the k photons nearest to point within radius. Safe to call from many threads at once.
+     * @param heap Receives pairs of squared distance and photon, as a max-heap.
+     * @return Squared radius of the searched sphere, the distance of the k-th photon if k were found.
+     */
+    double nearest(const Vector& point,const std::size_t& k,const double& radius,std::vector<std::pair<double,const Photon*>>& heap)const{
+        double maxDistSq=radius*radius;
+        heap.clear(),heap.reserve(k+1);
+        if(k)
+            search(0,photons.size(),point,k,maxDistSq,heap);
+        return maxDistSq;
+    }
+};
+
+/**
+ * Path tracer estimating caustics, light reaching a non-specular surface through specular reflections, from a PhotonMap.
+ * Photons are traced from Emitters again before each pass; path tracing skips the caustic paths the map accounts for.
+ */
+class PhotonMapper final:public Integrator{
+public:
+    Emitters emitters;
+    PhotonMap map;
+    ///Maximum number of bounces of a camera path.
+    std::size_t depth=8;
+    ///Number of photons emitted per pass.
+    std::size_t photons=100000;
+    ///Number of photons in a density estimate.
+    std::size_t nearest=64;
+    ///Maximum radius of a density estimate.
+    double radius=0.5;
+    ///Number of photon maps traced so far.
+    std::size_t iteration=0;
+    explicit PhotonMapper(Emitters emitters):emitters(std::move(emitters)){}
+    void prepare(const Hittable& scene)override{
+        constexpr std::size_t CHUNK=4096;
+        const std::size_t chunks=emitters.spheres.empty()?0:(photons+CHUNK-1)/CHUNK;
+        std::vector<std::vector<PhotonMap::Photon>> stored(chunks);
+        parallelFor(chunks,[&](const std::size_t& chunk){
+            Generator generator(iteration*0x9e3779b97f4a7c15^chunk);
+            for(std::size_t i=chunk*CHUNK;i<std::min(photons,(chunk+1)*CHUNK);++i){
+                const auto e=emitters.sample(generator);
+                const Light& light=*e.sphere->light;
+                Color power=light.color*(light.brightness*PI/(e.possibility*static_cast<double>(photons)));
+                Vector origin=e.point,ray=RandCosineVec3OnUnitHemisphere(generator,e.normal);
+                for(std::size_t bounce=0;bounce<depth;++bounce){
+                    const auto record=scene.hit(origin,ray,{0,INF});
+                    if(!record||!record->material)
+                        break;
+                    if(!record->material->specular()){
+                        if(bounce)
+                            stored[chunk].push_back({record->point,ray,power,0});
+                        break;
+                    }
+                    const Vector n=ray*record->normal<0?record->normal:-record->normal;
+                    power=hadamard(power,record->albedo());
+                    origin=record->point,ray=record->material->generate(n,reflect(ray,n));
+                }
+            }
+        });
+        std::vector<PhotonMap::Photon> all;
+        for(auto& chunk:stored)
+            all.insert(all.end(),chunk.begin(),chunk.end());
+        map=PhotonMap(std::move(all)),++iteration;
+    }
+    [[nodiscard]] Color radiance(const Hittable& scene,const Vector& origin,const Vector& ray,Generator&)const override{
+        thread_local std::vector<std::pair<double,const PhotonMap::Photon*>> heap;
+        Color ret{0,0,0},beta{1,1,1};
+        Vector o=origin,r=ray;
+        bool diffuse=false,caustic=false;
+        for(std::size_t i=0;i<depth;++i){
+            const auto record=scene.hit(o,r,{0,INF});
+            if(!record)
+                break;
+            if(record->light&&!caustic)
+                ret+=hadamard(beta,record->light->color*record->light->brightness);
+            if(!record->material)
+                break;
+            const Vector n=r*record->normal<0?record->normal:-record->normal;
+            beta=hadamard(beta,record->albedo());
+            if(record->material->specular())
+                caustic=diffuse;
+            else{
+                const double distSq=map.nearest(record->point,nearest,radius,heap);
+                Color sum{0,0,0};
+                for(const auto& [_,photon]:heap)
+                    if(const double c=-(photon->direction*n);c>0)
+                        sum+=photon->power*(record->material->possibility(reflect(r,n),-photon->direction)/c);
+                ret+=hadamard(beta,sum/(PI*distSq));
+                diffuse=true,caustic=false;
+            }
+            o=record->point,r=record->material->generate(n,reflect(r,n));
+        }
+        return ret;
+    }
+};
+
+/**
+ * Spatial-directional tree learning the distribution of incident radiance for path guiding.
+ * A binary tree halves the cubified bounds of a scene along x, y and z in turn, and each leaf holds two quadtrees over the sphere of directions,
+ * one sampled during a pass and one recording it, which replaces the first by refine() between passes.
+ */
+class SdTree{
+public:
+    ///Quadtree over the cylindrical mapping of the sphere to [0,1]^2, which preserves area.
+    class DTree{
+    public:
+        struct Node{
+            ///Energy of each quadrant, x in bit 0 and y in bit 1.
+            std::array<double,4> sum{};
+            ///Node index of each quadrant, 0 for a leaf.
+            std::array<std::uint32_t,4> child{};
+        };
+        std::vector<Node> nodes{1};
+        [[nodiscard]] double total()const{return nodes[0].sum[0]+nodes[0].sum[1]+nodes[0].sum[2]+nodes[0].sum[3];}
+
+        ///Sample a point of [0,1]^2 with density in proportion to the energy. total() must be positive.
+        void sample(Generator& generator,double& u,double& v)const{
+            std::uniform_real_distribution<> d(0,1);
+            double size=1;
+            u=v=0;
+            for(std::uint32_t i=0;;){
+                const Node& node=nodes[i];
+                double r=d(generator)*(node.sum[0]+node.sum[1]+node.sum[2]+node.sum[3]);
+                std::size_t c=0;
+                while(c<3&&(r>=node.sum[c]||!node.sum[c]))
+                    r-=node.sum[c++];
+                size/=2,u+=static_cast<double>(c&1)*size,v+=static_cast<double>(c>>1)*size;
+                if(!(i=node.child[c]))
+                    break;
+            }
+            u+=d(generator)*size,v+=d(generator)*size;
+        }
+
+        ///@return Density of sample() over [0,1]^2 at (u,v).
+        [[nodiscard]] double pdf(double u,double v)const{
+            double ret=1;
+            for(std::uint32_t i=0;;){
+                const Node& node=nodes[i];
+                const double total=node.sum[0]+node.sum[1]+node.sum[2]+node.sum[3];
+                if(total<=0)
+                    return ret;
+                const std::size_t c=(u>=0.5)|(v>=0.5)<<1;
+                ret*=4*node.sum[c]/total;
+                if(!(i=node.child[c])||!node.sum[c])
+                    return ret;
+                u=u*2-static_cast<double>(c&1),v=v*2-static_cast<double>(c>>1);
+            }
+        }
+
+        ///Add energy to every quadrant containing (u,v). Safe to call from many threads at once.
+        void record(double u,double v,const double& energy){
+            for(std::uint32_t i=0;;){
+                const std::size_t c=(u>=0.5)|(v>=0.5)<<1;
+                std::atomic_ref(nodes[i].sum[c]).fetch_add(energy,std::memory_order_relaxed);
+                if(!(i=nodes[i].child[c]))
+                    return;
+                u=u*2-static_cast<double>(c&1),v=v*2-static_cast<double>(c>>1);
+            }
+        }
+
+        ///@return A tree with the same energy, subdividing every quadrant holding more than threshold of it down to maxDepth levels.
+        [[nodiscard]] DTree refine(const double& threshold,const std::size_t& maxDepth)const{
+            DTree ret;
+            ret.nodes.clear();
+            const double all=total();
+            const auto build=[&](const auto& self,const std::uint32_t* old,const std::array<double,4>& energy,const std::size_t& depth)->std::uint32_t{
+                const auto index=static_cast<std::uint32_t>(ret.nodes.size());
+                ret.nodes.push_back({energy,{}});
+                for(std::size_t c=0;c<4;++c){
+                    if(!(all>0&&energy[c]>all*threshold&&depth<maxDepth))
+                        continue;
+                    const std::uint32_t* child=old&&nodes[*old].child[c]?&nodes[*old].child[c]:nullptr;
+                    const std::array<double,4> split=child?nodes[*child].sum:std::array<double,4>{energy[c]/4,energy[c]/4,energy[c]/4,energy[c]/4};
+                    const std::uint32_t node=self(self,child,split,depth+1);
+                    ret.nodes[index].child[c]=node;
+                }
+                return index;
+            };
+            const std::uint32_t root=0;
+            build(build,&root,nodes[0].sum,1);
+            return ret;
+        }
+    };
+    struct Leaf{
+        DTree sampling,building;
+        std::atomic<std::uint64_t> records=0;
+    };
+private:
+    struct Node{
+        ///Index of the first of two children, 0 for a leaf.
+        std::uint32_t child=0;
+        std::uint32_t leaf=0;
+    };
+    std::vector<Node> nodes{1};
+    Vector origin{0,0,0};
+    double size=1;
+public:
+    std::vector<std::unique_ptr<Leaf>> leaves;
+    SdTree()=default;
+    explicit SdTree(const Aabb& bounds):origin{bounds.x.min,bounds.y.min,bounds.z.min},size(std::max({bounds.x.length(),bounds.y.length(),bounds.z.length(),EPSILON})){
+        leaves.push_back(std::make_unique<Leaf>());
+    }
+
+    ///@return The leaf containing point.
+    [[nodiscard]] Leaf& leaf(const Vector& point)const{
+        double p[3]={(point.x-origin.x)/size,(point.y-origin.y)/size,(point.z-origin.z)/size};
+        std::uint32_t i=0;
+        for(std::size_t axis=0;nodes[i].child;axis=(axis+1)%3){
+            const bool upper=p[axis]>=0.5;
+            p[axis]=p[axis]*2-upper,i=nodes[i].child+upper;
+        }
+        return *leaves[nodes[i].leaf];
+    }
+
+    /**
+     * Start a new pass: every leaf samples what it has recorded so far and keeps recording into a refined copy.
+     * Leaves with more than spatialThreshold records since they were created are split in two.
+     */
+    void refine(const std::uint64_t& spatialThreshold,const double& threshold,const std::size_t& maxDepth){
+        for(std::size_t i=0,n=nodes.size();i<n;++i){
+            if(nodes[i].child)
+                continue;
+            Leaf& leaf=*leaves[nodes[i].leaf];
+            leaf.building=leaf.building.refine(threshold,maxDepth);
+            leaf.sampling=leaf.building;
+            if(leaf.records.load(std::memory_order_relaxed)<=spatialThreshold)
+                continue;
+            leaf.records.store(0,std::memory_order_relaxed);
+            const auto child=static_cast<std::uint32_t>(nodes.size());
+            auto copy=std::make_unique<Leaf>();
+            copy->sampling=leaf.sampling,copy->building=leaf.building;
+            nodes[i].child=child;
+            nodes.push_back({0,nodes[i].leaf}),nodes.push_back({0,static_cast<std::uint32_t>(leaves.size())});
+            leaves.push_back(std::move(copy));
+        }
+    }
+
+    ///@return Unit direction of point (u,v) of [0,1]^2.
+    static Vector direction(const double& u,const double& v){
+        const double z=u*2-1,r=std::sqrt(std::max(1-z*z,0.)),l=2*PI*v;
+        return{std::cos(l)*r,std::sin(l)*r,z};
+    }
+
+    ///Map unit direction d to the point (u,v) of [0,1]^2.
+    static void coordinates(const Vector& d,double& u,double& v){
+        u=std::clamp((d.z+1)/2,0.,1.);
+        v=std::atan2(d.y,d.x)/(2*PI);
+        v=v<0?v+1:v;
+    }
+};
+
+/**
+ * Path tracer guided by an SdTree learned over the passes of a Renderer.
+ * Non-specular vertices sample either Material::generate or the learned distribution, weighted by their mixture density.
+ */
+class GuidedPathTracer final:public Integrator{
+public:
+    SdTree tree;
+    std::size_t depth=8;
+    Color background{0,0,0};
+    ///Probability of sampling Material::generate once the tree has learned something.
+    double bsdfFraction=0.5;
+    ///Number of records after which a spatial leaf is split.
+    std::uint64_t spatialThreshold=12000;
+    ///Fraction of energy above which a quadrant is subdivided.
+    double fluxThreshold=0.01;
+    ///Maximum depth of the quadtrees.
+    std::size_t directionalDepth=20;
+    void prepare(const Hittable& scene)override{
+        if(tree.leaves.empty())
+            tree=SdTree(scene.aabb());
+        else
+            tree.refine(spatialThreshold,fluxThreshold,directionalDepth);
+    }
+    [[nodiscard]] Color radiance(const Hittable& scene,const Vector& origin,const Vector& ray,Generator& generator)const override{
+        struct Record{
+            SdTree::Leaf* leaf;
+            double u,v,pdf,beta;
+            Color before;
+        };
+        thread_local std::vector<Record> records;
+        std::uniform_real_distribution<> d(0,1);
+        Color ret{0,0,0};
+        Vector o=origin,r=ray;
+        Color beta{1,1,1};
+        records.clear(),records.reserve(depth);
+        for(std::size_t i=0;i<depth;++i){
+            const auto record=scene.hit(o,r,{0,INF});
+            if(!record){
+                ret+=hadamard(background,beta);
+                break;
+            }
+            if(record->light)
+                ret+=hadamard(beta,record->light->color*record->light->brightness);
+            if(!record->material)
+                break;
+            const Vector n=r*record->normal<0?record->normal:-record->normal,theoretic=reflect(r,n);
+            o=record->point,beta=hadamard(beta,record->albedo());
+            if(record->material->specular()||tree.leaves.empty()){
+                r=record->material->generate(n,theoretic);
+                continue;
+            }
+            SdTree::Leaf& leaf=tree.leaf(o);
+            const double alpha=leaf.sampling.total()>0?bsdfFraction:1;
+            double u,v;
+            if(d(generator)<alpha)
+                r=record->material->generate(n,theoretic),SdTree::coordinates(r,u,v);
+            else
+                leaf.sampling.sample(generator,u,v),r=SdTree::direction(u,v);
+            if(r*n<=0)
+                break;
+            const double possibility=record->material->possibility(theoretic,r),
+                         pdf=alpha*possibility+(alpha<1?(1-alpha)*leaf.sampling.pdf(u,v)/(4*PI):0);
+            if(pdf<=0)
+                break;
+            beta=beta*(possibility/pdf);
+            records.push_back({&leaf,u,v,pdf,luminance(beta),ret});
+        }
+        for(const auto& [leaf,u,v,pdf,b,before]:records){
+            if(b>0)
+                leaf->building.record(u,v,luminance(ret-before)/(b*pdf));
+            leaf->records.fetch_add(1,std::memory_order_relaxed);
+        }
+        return ret;
+    }
+};
+
+///NUMA nodes with the cpus of each that this process may run on, read from /sys on Linux.
+struct NumaTopology{
+    std::vector<std::vector<int>> nodes;
+
+    ///@return The topology of the machine, with no nodes if it is unavailable.
+    static NumaTopology current(){
+        NumaTopology ret;
+#ifdef __linux__
+        cpu_set_t allowed;
+        if(sched_getaffinity(0,sizeof(allowed),&allowed))
+            return ret;
+        std::error_code error;
+        for(const auto& entry:std::filesystem::directory_iterator("/sys/devices/system/node",error)){
+            const std::string name=entry.path().filename().string();
+            if(!name.starts_with("node")||name.find_first_not_of("0123456789",4)!=std::string::npos)
+                continue;
+            std::ifstream in(entry.path()/"cpulist");
+            std::vector<int> cpus;
+            std::string range;
+            while(std::getline(in,range,',')){
+                int first=0,last=0;
+                if(const int n=std::sscanf(range.c_str(),"%d-%d",&first,&last);n==1)
+                    last=first;
+                else if(n!=2)
+                    continue;
+                for(int cpu=first;cpu<=last;++cpu)
+                    if(cpu<CPU_SETSIZE&&CPU_ISSET(cpu,&allowed))
+                        cpus.push_back(cpu);
+            }
+            if(!cpus.empty())
+                ret.nodes.push_back(std::move(cpus));
+        }
+#endif
+        return ret;
+    }
+
+    ///Restrict the calling thread to cpus. @return true on success.
+    static bool pin(const std::vector<int>& cpus){
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(const auto& cpu:cpus)
+            CPU_SET(cpu,&set);
+        return !sched_setaffinity(0,sizeof(set),&set);
+#else
+        return cpus.empty();
+#endif
+    }
+
+    ///Saves the cpus the calling thread may run on and restores them when destroyed, undoing pin even if an exception is thrown.
+    class AffinityGuard{
+#ifdef __linux__
+        cpu_set_t saved;
+        bool valid;
+    public:
+        AffinityGuard():valid(!sched_getaffinity(0,sizeof(saved),&saved)){}
+        ~AffinityGuard(){
+            if(valid)
+                sched_setaffinity(0,sizeof(saved),&saved);
+        }
+#else
+    public:
+        AffinityGuard()=default;
+#endif
+        AffinityGuard(const AffinityGuard&)=delete;
+        AffinityGuard& operator=(const AffinityGuard&)=delete;
+    };
+};
+
+struct RenderOptions{
+    ///Number of render threads, 0 for the hardware concurrency.
+    std::size_t threads=0;
+    ///Number of samples per pixel to accumulate. Ignored with a budget.
+    std::size_t passes=1;
+    /**
+     * Spread threads over NUMA nodes and pin them there, giving each node a contiguous range of tiles allocated on its memory.
+     * Idle threads steal tiles from other nodes. Has no effect on machines with a single node.
+     */
+    bool numa=false;
+    ///With numa, render a BvhTree scene from a copy of its nodes made on each node.
+    bool replicate=false;
+    ///How contributions of splatting integrators are accumulated.
+    SplatMode splatting=SplatMode::deterministic;
+    /**
+     * Wall-clock time to finish the frame in, unlimited if zero. Passes are rendered until it runs out, however many passes asks for.
+     * The first pass always renders every tile and measures the cost of a tile. After each pass the samples the rest of the budget affords
+     * are planned over tiles and the next pass renders the tiles furthest below their share, as many as fit in the time left.
+     */
+    std::chrono::duration<double> budget{0};
+    /**
+     * With a budget, share samples among tiles in proportion to their estimated noise, the standard deviation of sample luminance relative to
+     * the mean plus 1/16, rather than uniformly. Ignored for splatting integrators, whose passes have to cover every tile.
+     */
+    bool adaptive=false;
+    /**
+     * Indices of the tiles to render, such as Framebuffer::tilesIn() a crop window or Framebuffer::dirtyTiles(), all if empty.
+     * The other tiles keep their samples. Ignored for splatting integrators, whose samples reach every tile.
+     * Renderer::render throws std::out_of_range for an index past the tiles of the Framebuffer.
+     */
+    std::vector<std::size_t> tiles;
+    ///Record Framebuffer::firstHits for the tiles rendered from their first sample.
+    bool firstHits=false;
+    ///Mixed into the random numbers of every tile, so that frames rendered with different seeds, such as the frame index, have independent noise.
+    std::uint64_t seed=0;
+};
+
+///Renderer running an Integrator over the tiles of a Framebuffer in parallel.
+class Renderer{
+    void renderTile(const Hittable& scene,const Camera& camera,const Integrator& integrator,Framebuffer& framebuffer,Splatter& splatter,const std::size_t& index,const bool& squares)const{
+        Framebuffer::Tile& tile=framebuffer.tiles[index];
+        Generator& generator=threadGenerator();
+        generator.seed(index*0x9e3779b97f4a7c15^options.seed*0xc2b2ae3d27d4eb4f^tile.samples);
+        tile.allocate();
+        if(options.firstHits&&!tile.samples)
+            for(std::size_t y=tile.y;y<tile.y+tile.height;++y)
+                for(std::size_t x=tile.x;x<tile.x+tile.width;++x){
+                    const auto record=scene.hit(camera.position,camera.ray(static_cast<double>(x)+0.5,static_cast<double>(y)+0.5),{0,INF});
+                    framebuffer.firstHits[y*framebuffer.width+x]=record?record->object:nullptr;
+                }
+        thread_local std::vector<Color> previous;
+        if(squares)
+            previous.reserve(framebuffer.tileSize*framebuffer.tileSize),previous.assign(tile.sum.begin(),tile.sum.end());
+        integrator.sampleTile(scene,camera,tile,generator,splatter);
+        if(squares)
+            for(std::size_t i=0;i<previous.size();++i){
+                const double l=luminance(tile.sum[i]-previous[i]);
+                tile.squares+=l*l;
+            }
+        ++tile.samples;
+    }
+
+    /**
+     * Choose the tiles of the next pass of a budgeted render, given the thread-seconds a tile costs and the seconds left.
+     * @return false if not even one round of tiles fits.
+     */
+    bool plan(const Framebuffer& framebuffer,const std::vector<char>& region,std::vector<char>& scheduled,const std::size_t& threads,const double& cost,const double& left,const bool& adaptive,const bool& splats)const{
+        const std::size_t tiles=framebuffer.tiles.size(),fits=static_cast<std::size_t>(std::clamp(left/cost,0.,1e12))*threads;
+        if(!fits||(splats&&fits<tiles))
+            return false;
+        std::vector<double> weights(region.begin(),region.end()),deficits(tiles,-INF);
+        std::size_t total=fits;
+        for(std::size_t i=0;i<tiles;++i){
+            const Framebuffer::Tile& tile=framebuffer.tiles[i];
+            if(region[i])
+                total+=tile.samples;
+            if(!region[i]||!adaptive||splats||tile.samples<2)
+                continue;
+            double mean=0,squared=0;
+            for(const Color& c:tile.sum){
+                const double l=luminance(c)/tile.samples;
+                mean+=l,squared+=l*l;
+            }
+            const double pixels=static_cast<double>(tile.sum.size()),variance=std::max(tile.squares/tile.samples-squared,0.)/pixels;
+            weights[i]=std::sqrt(variance)/(mean/pixels+1./16);
+        }
+        const double sum=std::accumulate(weights.begin(),weights.end(),0.);
+        for(std::size_t i=0;i<tiles;++i){
+            const Framebuffer::Tile& tile=framebuffer.tiles[i];
+            if(!region[i])
+                continue;
+            //Adaptive tiles need two samples before their noise can be estimated.
+            deficits[i]=adaptive&&!splats&&tile.samples<2?INF:(sum>0?static_cast<double>(total)*weights[i]/sum:0)-tile.samples;
+        }
+        std::vector<std::size_t> order(tiles);
+        std::iota(order.begin(),order.end(),0);
+        std::stable_sort(order.begin(),order.end(),[&](const std::size_t& a,const std::size_t& b){return deficits[a]>deficits[b];});
+        const std::size_t below=std::count_if(deficits.begin(),deficits.end(),[](const double& d){return d>0;});
+        std::fill(scheduled.begin(),scheduled.end(),0);
+        for(std::size_t i=0;i<std::min(fits,splats?tiles:std::max<std::size_t>(below,1))&&region[order[i]];++i)
+            scheduled[order[i]]=1;
+        return true;
+    }
+public:
+    RenderOptions options;
+    explicit Renderer(const RenderOptions& options={}):options(options){}
+
+    ///Accumulate options.passes samples per pixel of camera into framebuffer, or as many as options.budget allows if it is set.
+    void render(const Hittable& scene,const Camera& camera,Integrator& integrator,Framebuffer& framebuffer)const{
+        const std::size_t threads=options.threads?options.threads:std::max(std::thread::hardware_concurrency(),1u);
+        const NumaTopology topology=options.numa?NumaTopology::current():NumaTopology{};
+        const std::size_t nodes=std::max<std::size_t>(topology.nodes.size(),1),tiles=framebuffer.tiles.size();
+        for(const std::size_t& i:options.tiles)
+            if(i>=tiles)
+                throw std::out_of_range("RenderOptions::tiles: tile "+std::to_string(i)+" of "+std::to_string(tiles));
+        std::size_t cpus=0;
+        for(const auto& node:topology.nodes)
+            cpus+=node.size();
+        //Threads and tiles are split among nodes in proportion to their cpus.
+        std::vector<std::size_t> threadBegin(nodes+1,0),tileBegin(nodes+1,0);
+        for(std::size_t i=1,sum=0;i<=nodes;++i){
+            sum+=nodes>1?topology.nodes[i-1].size():1;
+            threadBegin[i]=nodes>1?threads*sum/cpus:threads;
+            tileBegin[i]=nodes>1?tiles*sum/cpus:tiles;
+        }
+        const auto* bvh=options.numa&&options.replicate&&nodes>1?dynamic_cast<const BvhTree*>(&scene):nullptr;
+        std::vector<std::unique_ptr<const BvhTree>> replicas(nodes);
+        const auto cursors=std::make_unique<std::atomic<std::size_t>[]>(nodes);
+        const auto reset=[&]{
+            for(std::size_t i=0;i<nodes;++i)
+                cursors[i].store(tileBegin[i],std::memory_order_relaxed);
+        };
+        reset();
+        const bool splats=integrator.splats();
+        if(splats&&framebuffer.splat.empty())
+            framebuffer.splat.assign(framebuffer.width*framebuffer.height,Color{0,0,0});
+        //Deterministic splats are kept per tile and merged block by block in tile order after each pass.
+        const std::size_t blocksPerRow=(framebuffer.width+Splatter::BLOCK-1)/Splatter::BLOCK;
+        std::vector<std::vector<Splatter::Block>> pending(splats&&options.splatting==SplatMode::deterministic?tiles:0);
+        std::vector<std::vector<const Splatter::Block*>> merging;
+        std::atomic<std::size_t> mergeCursor=0;
+        bool merge=false;
+        std::size_t passes=0;
+        //Budgeted rendering: tiles of the current pass, thread-seconds spent and tiles rendered so far.
+        const bool budgeted=options.budget.count()>0,squares=budgeted&&options.adaptive&&!splats;
+        const std::size_t limit=budgeted?std::numeric_limits<std::size_t>::max():options.passes;
+        const auto start=std::chrono::steady_clock::now();
+        std::vector<char> region(tiles,options.tiles.empty()||splats);
+        for(const std::size_t& i:options.tiles)
+            region[i]=1;
+        std::vector<char> scheduled=region;
+        if(options.firstHits&&framebuffer.firstHits.empty())
+            framebuffer.firstHits.assign(framebuffer.width*framebuffer.height,nullptr);
+        std::atomic<std::size_t> rendered=0;
+        bool stop=false,preparing=false;
+        //Exception thrown by Integrator::prepare between passes, rethrown after the threads joined.
+        std::exception_ptr failure;
+        if(limit)
+            integrator.prepare(scene);
+        std::latch ready(static_cast<std::ptrdiff_t>(threads));
+        //Integrator::prepare may allocate, fail and run parallelFor, so it runs on thread 0 between this and the pass barrier rather than in the noexcept completion.
+        std::barrier prepared(static_cast<std::ptrdiff_t>(threads));
+        std::barrier barrier(static_cast<std::ptrdiff_t>(threads),[&]()noexcept{
+            if(!pending.empty()&&!merge){
+                merging.assign(blocksPerRow*((framebuffer.height+Splatter::BLOCK-1)/Splatter::BLOCK),{});
+                for(const auto& blocks:pending)
+                    for(const auto& block:blocks)
+                        merging[block.index].push_back(&block);
+                mergeCursor.store(0,std::memory_order_relaxed),merge=true;
+                return;
+            }
+            for(auto& blocks:pending)
+                blocks.clear();
+            framebuffer.splatSamples+=splats,merge=false;
+            reset();
+            if(budgeted){
+                const double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+                const double cost=elapsed*static_cast<double>(threads)/static_cast<double>(std::max<std::size_t>(rendered.load(std::memory_order_relaxed),1));
+                stop=!plan(framebuffer,region,scheduled,threads,cost,options.budget.count()-elapsed,options.adaptive,splats);
+            }
+            preparing=++passes<limit&&!stop;
+        });
+        const auto work=[&](const std::size_t& thread){
+            const std::size_t node=std::upper_bound(threadBegin.begin(),threadBegin.end(),thread)-threadBegin.begin()-1;
+            if(nodes>1){
+                NumaTopology::pin(topology.nodes[node]);
+                if(thread==threadBegin[node]){
+                    if(bvh)
+                        replicas[node]=std::make_unique<const BvhTree>(*bvh);
+                    for(std::size_t i=tileBegin[node];i<tileBegin[node+1];++i)
+                        framebuffer.tiles[i].allocate();
+                }
+            }
+            Splatter splatter;
+            if(splats)
+                splatter.framebuffer=&framebuffer,splatter.mode=options.splatting,splatter.blocksPerRow=blocksPerRow;
+            ready.arrive_and_wait();
+            const Hittable& local=replicas[node]?*replicas[node]:scene;
+            //Largest tile rendered by this thread so far, in pixels.
+            std::size_t warmed=0;
+            for(std::size_t pass=0;pass<limit&&!stop;++pass){
+                for(std::size_t i=0;i<nodes;++i){
+                    const std::size_t n=(node+i)%nodes;
+                    for(std::size_t tile;(tile=cursors[n].fetch_add(1,std::memory_order_relaxed))<tileBegin[n+1];){
+                        if(!scheduled[tile])
+                            continue;
+                        //Once a tile has its buffers and the thread has rendered one as large, its scratch buffers have grown to their working size.
+                        //Buffering deterministic splats still allocates.
+                        const std::size_t pixels=framebuffer.tiles[tile].width*framebuffer.tiles[tile].height;
+                        {
+                            const AllocationScope scope(framebuffer.tiles[tile].samples&&pixels<=warmed&&pending.empty());
+                            renderTile(local,camera,integrator,framebuffer,splatter,tile,squares);
+                        }
+                        warmed=std::max(warmed,pixels);
+                        if(budgeted)
+                            rendered.fetch_add(1,std::memory_order_relaxed);
+                        if(!pending.empty())
+                            pending[tile]=splatter.take();
+                    }
+                }
+                barrier.arrive_and_wait();
+                if(!pending.empty()){
+                    for(std::size_t i;(i=mergeCursor.fetch_add(1,std::memory_order_relaxed))<merging.size();)
+                        for(const auto* block:merging[i]){
+                            const std::size_t x0=i%blocksPerRow*Splatter::BLOCK,y0=i/blocksPerRow*Splatter::BLOCK;
+                            for(std::size_t y=y0;y<std::min(y0+Splatter::BLOCK,framebuffer.height);++y)
+                                for(std::size_t x=x0;x<std::min(x0+Splatter::BLOCK,framebuffer.width);++x)
+                                    framebuffer.splat[y*framebuffer.width+x]+=block->sum[(y-y0)*Splatter::BLOCK+x-x0];
+                        }
+                    barrier.arrive_and_wait();
+                }
+                if(!preparing)
+                    continue;
+                if(!thread)
+                    try{
+                        integrator.prepare(scene);
+                    }catch(...){
+                        failure=std::current_exception(),stop=true;
+                    }
+                prepared.arrive_and_wait();
+            }
+        };
+        //The calling thread renders as thread 0 and is pinned with the others, so it gets its affinity back afterwards.
+        const NumaTopology::AffinityGuard affinity;
+        std::vector<std::jthread> workers;
+        for(std::size_t i=1;i<threads;++i)
+            workers.emplace_back(work,i);
+        work(0);
+        workers.clear();
+        if(failure)
+            std::rethrow_exception(failure);
+    }
+};
+
+/**
+ * Reuse of the samples of previous frames of an animated camera, for a static scene.
+ * Each frame traces the ray through every pixel center for a depth and normal buffer, whose points project to the previous camera
+ * as motion vectors. The history is bilinearly fetched there from the taps that saw the same surface, blended with the new samples,
+ * and clamped to the range of colors around the pixel in the new frame so that stale lighting does not ghost.
+ * Frames have to be rendered with different RenderOptions::seed, otherwise their noise is the same and does not average out.
+ */
+class TemporalFilter{
+    std::optional<Camera> camera;
+    std::vector<Color> colors;
+    ///History length in samples, 0 where there is none.
+    std::vector<double> lengths,depths;
+    std::vector<Vector> normals;
+public:
+    ///Maximum history length in samples, trading noise for lag behind changes in lighting.
+    double maxHistory=32;
+    ///Largest difference in depth, relative to the depth, for a previous pixel to see the same surface.
+    double depthTolerance=0.05;
+    ///Smallest cosine between the normals of a pixel and its previous pixels.
+    double normalTolerance=0.9;
+    ///Clamp the history to the bounds of the colors of the 3*3 pixels around in the new frame.
+    bool clamp=true;
+    ///Number of threads, all hardware threads if 0.
+    std::size_t threads=0;
+
+    ///Forget the history, after a cut.
+    void reset(){camera.reset();}
+
+    /**
+     * Combine frame, rendered from camera, with the history and make the result the history of the next frame.
+     * @return The filtered frame, one sample per pixel, for encodeSrgb8() or encodeHalf().
+     */
+    Framebuffer filter(const Hittable& scene,const Camera& camera,const Framebuffer& frame){
+        const std::size_t width=frame.width,height=frame.height;
+        if(this->camera&&(this->camera->width!=width||this->camera->height!=height))
+            reset();
+        std::vector<Color> current(width*height),resolved(width*height);
+        std::vector<double> lengths(width*height),depths(width*height);
+        std::vector<Vector> normals(width*height);
+        parallelFor(height,[&](const std::size_t& y){
+            for(std::size_t x=0;x<width;++x){
+                const std::size_t i=y*width+x;
+                const Vector ray=camera.ray(static_cast<double>(x)+0.5,static_cast<double>(y)+0.5);
+                const auto record=scene.hit(camera.position,ray,{0,INF});
+                depths[i]=record?record->dist:INF,normals[i]=record?record->normal:-ray;
+                current[i]=frame.pixel(x,y);
+            }
+        },threads);
+        parallelFor(height,[&](const std::size_t& y){
+            for(std::size_t x=0;x<width;++x){
+                const std::size_t i=y*width+x;
+                const double samples=frame.tiles[frame.tileIndex(x,y)].samples;
+                resolved[i]=current[i],lengths[i]=samples;
+                const Vector ray=camera.ray(static_cast<double>(x)+0.5,static_cast<double>(y)+0.5);
+                double px,py;
+                //Misses are projected by direction alone, as if infinitely far.
+                const bool miss=depths[i]==INF;
+                if(!this->camera||!this->camera->project(miss?this->camera->position+ray:camera.position+ray*depths[i],px,py))
+                    continue;
+                px-=0.5,py-=0.5;
+                if(!(px>-1&&py>-1&&px<static_cast<double>(width)&&py<static_cast<double>(height)))
+                    continue;
+                const Vector point=camera.position+ray*depths[i];
+                const double fx=std::floor(px),fy=std::floor(py),ax=px-fx,ay=py-fy;
+                Color history{0,0,0};
+                double weight=0,length=0;
+                for(std::size_t t=0;t<4;++t){
+                    const double tx=fx+static_cast<double>(t&1),ty=fy+static_cast<double>(t>>1),w=(t&1?ax:1-ax)*(t>>1?ay:1-ay);
+                    if(w<=0||tx<0||ty<0||tx>=static_cast<double>(width)||ty>=static_cast<double>(height))
+                        continue;
+                    const std::size_t j=static_cast<std::size_t>(ty)*width+static_cast<std::size_t>(tx);
+                    if(!this->lengths[j]||(this->depths[j]==INF)!=miss)
+                        continue;
+                    //Disocclusion: the previous pixel saw another surface.
+                    if(!miss&&(std::abs(this->depths[j]-norm(point-this->camera->position))>depthTolerance*this->depths[j]||normals[i]*this->normals[j]<normalTolerance))
+                        continue;
+                    history+=colors[j]*w,length+=this->lengths[j]*w,weight+=w;
+                }
+                if(!weight)
+                    continue;
+                history/=weight,length=std::min(length/weight,maxHistory-samples);
+                if(length<=0)
+                    continue;
+                if(clamp){
+                    Color low=current[i],high=current[i];
+                    for(std::size_t ny=y?y-1:0;ny<std::min(y+2,height);++ny)
+                        for(std::size_t nx=x?x-1:0;nx<std::min(x+2,width);++nx){
+                            const Color& c=current[ny*width+nx];
+                            low={std::min(low.x,c.x),std::min(low.y,c.y),std::min(low.z,c.z)};
+                            high={std::max(high.x,c.x),std::max(high.y,c.y),std::max(high.z,c.z)};
+                        }
+                    history={std::clamp(history.x,low.x,high.x),std::clamp(history.y,low.y,high.y),std::clamp(history.z,low.z,high.z)};
+                }
+                resolved[i]=(current[i]*samples+history*length)/(samples+length),lengths[i]=samples+length;
+            }
+        },threads);
+        this->camera=camera,colors=resolved,this->lengths=std::move(lengths),this->depths=std::move(depths),this->normals=std::move(normals);
+        Framebuffer ret(width,height,frame.tileSize);
+        for(Framebuffer::Tile& tile:ret.tiles){
+            tile.allocate(),tile.samples=1;
+            for(std::size_t y=0;y<tile.height;++y)
+                std::copy_n(resolved.begin()+static_cast<std::ptrdiff_t>((tile.y+y)*width+tile.x),tile.width,tile.sum.begin()+static_cast<std::ptrdiff_t>(y*tile.width));
+        }
+        return ret;
+    }
+};
+
+///First-in first-out queue between threads, blocking producers while it holds capacity items.
+template<typename T>class BoundedQueue{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<T> items;
+    bool closed=false;
+public:
+    const std::size_t capacity;
+    explicit BoundedQueue(const std::size_t& capacity):capacity(std::max<std::size_t>(capacity,1)){}
+
+    ///Wait for room and append item. @return false, dropping item, if the queue is closed.
+    bool push(T item){
+        std::unique_lock lock(mutex);
+        changed.wait(lock,[&]{return items.size()<capacity||closed;});
+        if(closed)
+            return false;
+        items.push_back(std::move(item));
+        changed.notify_all();
+        return true;
+    }
+
+    ///Wait for an item and remove it. @return The item, or nothing once the queue is closed and empty.
+    std::optional<T> pop(){
+        std::unique_lock lock(mutex);
+        changed.wait(lock,[&]{return !items.empty()||closed;});
+        if(items.empty())
+            return std::nullopt;
+        std::optional<T> ret(std::move(items.front()));
+        items.pop_front();
+        changed.notify_all();
+        return ret;
+    }
+
+    ///Tell consumers that no more items come, and make producers fail.
+    void close(){
+        std::lock_guard lock(mutex);
+        closed=true;
+        changed.notify_all();
+    }
+
+    ///Close and drop the waiting items.
+    void cancel(){
+        std::lock_guard lock(mutex);
+        closed=true,items.clear();
+        changed.notify_all();
+    }
+};
+
+/**
+ * Renderer of animation sequences, overlapping the stages of consecutive frames: while frame n renders,
+ * frame n+1 is prepared (scene updated, BvhTree built or refitted) on one thread and frame n-1 is output (encoded, written) on another.
+ * The stages are connected by BoundedQueue, so at most depth frames wait on each side of the Renderer.
+ */
+class SequenceRenderer{
+public:
+    struct Frame{
+        std::size_t index;
+        std::shared_ptr<const Hittable> scene;
+        Camera camera;
+    };
+    RenderOptions options;
+    ///Capacity of the queues between stages.
+    std::size_t depth=1;
+    explicit SequenceRenderer(const RenderOptions& options={}):options(options){}
+
+    /**
+     * Render frames [0,count) with integrator, each at the resolution of its camera.
+     * @param prepare Called as prepare(index) in order on the preparation thread, returning the Frame. Scenes in flight must stay unchanged,
+     * so a refitted BvhTree has to be a copy of the one of the previous frame, or one of depth+2 trees used in turn.
+     * @param output Called as output(index,Framebuffer&&) in order on the output thread.
+     * Frame i is rendered with RenderOptions::seed options.seed+i, so that its noise is independent of the other frames.
+     * If a stage throws, the others stop at their next queue operation and the first exception, in stage order, is rethrown here.
+     */
+    template<typename P,typename O>void render(const std::size_t& count,Integrator& integrator,const P& prepare,const O& output)const{
+        using Images=BoundedQueue<std::pair<std::size_t,Framebuffer>>;
+        BoundedQueue<Frame> frames(depth);
+        Images images(depth);
+        std::exception_ptr errors[3];
+        const auto fail=[&](std::exception_ptr& error){
+            error=std::current_exception();
+            frames.cancel(),images.cancel();
+        };
+        {
+            std::jthread preparing,writing;
+            //Destroyed before the threads join, so that stages blocked on a queue return on every exit.
+            struct Closing{
+                BoundedQueue<Frame>& frames;
+                Images& images;
+                ~Closing(){frames.close(),images.close();}
+            }const closing{frames,images};
+            preparing=std::jthread([&]{
+                try{
+                    for(std::size_t i=0;i<count&&frames.push(prepare(i));++i);
+                }catch(...){
+                    fail(errors[0]);
+                }
+                frames.close();
+            });
+            writing=std::jthread([&]{
+                try{
+                    while(auto image=images.pop())
+                        output(image->first,std::move(image->second));
+                }catch(...){
+                    fail(errors[2]);
+                }
+            });
+            try{
+                Renderer renderer(options);
+                while(auto frame=frames.pop()){
+                    renderer.options.seed=options.seed+frame->index;
+                    Framebuffer framebuffer(frame->camera.width,frame->camera.height);
+                    renderer.render(*frame->scene,frame->camera,integrator,framebuffer);
+                    if(!images.push({frame->index,std::move(framebuffer)}))
+                        break;
+                }
+            }catch(...){
+                fail(errors[1]);
+            }
+        }
+        for(const auto& error:errors)
+            if(error)
+                std::rethrow_exception(error);
+    }
+};
+
+enum class ToneMap{
+    ///Clamp to [0,1].
+    clamp,
+    ///x/(1+x), compressing highlights gently.
+    reinhard,
+    ///Narkowicz's fit of the ACES filmic curve.
+    aces
+};
+
+///Conversion of a Framebuffer to display output.
+struct ToneMapOptions{
+    ///Exposure in stops, scaling the image by 2^exposure before the curve.
+    double exposure=0;
+    ToneMap curve=ToneMap::aces;
+    ///Add triangular noise of one quantization step before rounding to 8 bits, hiding banding.
+    bool dither=true;
+    ///Number of threads, all hardware threads if 0.
+    std::size_t threads=0;
+};
+
+///@return Half-precision bits of f, rounded to nearest even.
+inline std::uint16_t half(const float& f){
+    const std::uint32_t bits=std::bit_cast<std::uint32_t>(f),sign=bits>>16&0x8000,magnitude=bits&0x7fffffff;
+    if(magnitude>=0x47800000)
+        return static_cast<std::uint16_t>(sign|(magnitude>0x7f800000?0x7e00:0x7c00));
+    if(magnitude<0x38800000)
+        return static_cast<std::uint16_t>(sign|static_cast<std::uint32_t>(std::nearbyint(std::bit_cast<float>(magnitude)*0x1p24f)));
+    return static_cast<std::uint16_t>(sign|(magnitude-0x38000000+0xfff+(magnitude>>13&1))>>13);
+}
+
+/**
+ * Run f(y,x,values,count) over every row of every tile of framebuffer in parallel over tiles,
+ * where values holds the red, green and blue pixel means of count pixels from (x,y) as three arrays of floats scaled by 2^exposure.
+ */
+template<typename F>void forEachBatch(const Framebuffer& framebuffer,const ToneMapOptions& options,const F& f){
+    constexpr std::size_t BATCH=64;
+    const auto scale=static_cast<float>(std::exp2(options.exposure));
+    parallelFor(framebuffer.tiles.size(),[&](const std::size_t& t){
+        const Framebuffer::Tile& tile=framebuffer.tiles[t];
+        const float sampleScale=tile.samples?scale/static_cast<float>(tile.samples):0,
+                    splatScale=framebuffer.splatSamples?scale/static_cast<float>(framebuffer.splatSamples):0;
+        alignas(64) float values[3][BATCH];
+        dispatch([&]{
+            for(std::size_t y=tile.y;y<tile.y+tile.height;++y)
+                for(std::size_t x=tile.x;x<tile.x+tile.width;x+=BATCH){
+                    const std::size_t count=std::min(BATCH,tile.x+tile.width-x);
+                    const Color* sum=tile.samples?tile.sum.data()+(y-tile.y)*tile.width+x-tile.x:nullptr;
+                    const Color* splat=framebuffer.splatSamples?framebuffer.splat.data()+y*framebuffer.width+x:nullptr;
+                    for(std::size_t i=0;i<count;++i){
+                        values[0][i]=sum?static_cast<float>(sum[i].x)*sampleScale:0;
+                        values[1][i]=sum?static_cast<float>(sum[i].y)*sampleScale:0;
+                        values[2][i]=sum?static_cast<float>(sum[i].z)*sampleScale:0;
+                    }
+                    if(splat)
+                        for(std::size_t i=0;i<count;++i){
+                            values[0][i]+=static_cast<float>(splat[i].x)*splatScale;
+                            values[1][i]+=static_cast<float>(splat[i].y)*splatScale;
+                            values[2][i]+=static_cast<float>(splat[i].z)*splatScale;
+                        }
+                    f(y,x,values,count);
+                }
+        });
+    },options.threads);
+}
+
+///@return sRGB encoding of i/size for i in [0,size], followed by a copy of the last entry.
+template<std::size_t size>const std::array<float,size+2>& srgbTable(){
+    static const std::array<float,size+2> table=[]{
+        std::array<float,size+2> ret{};
+        for(std::size_t i=0;i<=size;++i){
+            const double x=static_cast<double>(i)/size;
+            ret[i]=static_cast<float>(x<=0.0031308?x*12.92:1.055*std::pow(x,1/2.4)-0.055);
+        }
+        ret[size+1]=ret[size];
+        return ret;
+    }();
+    return table;
+}
+
+/**
+ * Convert framebuffer to interleaved 8-bit sRGB in row-major order: exposure, tone curve, sRGB encoding through a table, and optional dithering.
+ * Each row of a tile is processed in batches of floats laid out for auto-vectorization.
+ */
+inline std::vector<std::uint8_t> encodeSrgb8(const Framebuffer& framebuffer,const ToneMapOptions& options={}){
+    constexpr std::size_t TABLE=4096;
+    const auto& table=srgbTable<TABLE>();
+    std::vector<std::uint8_t> ret(framebuffer.width*framebuffer.height*3);
+    forEachBatch(framebuffer,options,[&](const std::size_t& y,const std::size_t& x0,auto& values,const std::size_t& count){
+        for(auto& channel:values)
+            switch(options.curve){
+            case ToneMap::clamp:
+                break;
+            case ToneMap::reinhard:
+                for(std::size_t i=0;i<count;++i)
+                    channel[i]=std::max(channel[i],0.f)/(1+std::max(channel[i],0.f));
+                break;
+            case ToneMap::aces:
+                for(std::size_t i=0;i<count;++i){
+                    const float v=std::max(channel[i],0.f);
+                    channel[i]=v*(2.51f*v+0.03f)/(v*(2.43f*v+0.59f)+0.14f);
+                }
+                break;
+            }
+        std::uint8_t* out=ret.data()+(y*framebuffer.width+x0)*3;
+        for(std::size_t c=0;c<3;++c)
+            for(std::size_t i=0;i<count;++i){
+                const float v=std::clamp(values[c][i],0.f,1.f)*TABLE;
+                const auto j=static_cast<std::size_t>(v);
+                float encoded=(table[j]+(table[j+1]-table[j])*(v-static_cast<float>(j)))*255+0.5f;
+                if(options.dither){
+                    std::uint32_t h=static_cast<std::uint32_t>((y*framebuffer.width+x0+i)*3+c)*0x9e3779b9u;
+                    h=(h^h>>16)*0x85ebca6bu;
+                    h^=h>>13;
+                    encoded+=static_cast<float>(h&0xffff)/65536.f-static_cast<float>(h>>16)/65536.f;
+                }
+                out[i*3+c]=static_cast<std::uint8_t>(std::clamp(encoded,0.f,255.f));
+            }
+    });
+    return ret;
+}
+
+///Convert framebuffer after exposure to interleaved linear half floats in row-major order, as stored by OpenEXR. The curve and dithering are not applied.
+inline std::vector<std::uint16_t> encodeHalf(const Framebuffer& framebuffer,const ToneMapOptions& options={}){
+    std::vector<std::uint16_t> ret(framebuffer.width*framebuffer.height*3);
+    forEachBatch(framebuffer,options,[&](const std::size_t& y,const std::size_t& x0,auto& values,const std::size_t& count){
+        std::uint16_t* out=ret.data()+(y*framebuffer.width+x0)*3;
+        for(std::size_t c=0;c<3;++c)
+            for(std::size_t i=0;i<count;++i)
+                out[i*3+c]=half(values[c][i]);
+    });
+    return ret;
+}
+}
+
+#ifdef C3D_CHECK_ALLOCATIONS
+//Replacements of the global allocation functions, plain, aligned and nothrow, aborting where c3d::allocationForbidden(), for tests checking that the render loop does not allocate.
+//Define C3D_CHECK_ALLOCATIONS in a single translation unit of the program.
+void* operator new(std::size_t size){
+    if(c3d::allocationForbidden())
+        std::fprintf(stderr,"c3d: heap allocation of %zu bytes where allocation is forbidden\n",size),std::abort();
+    if(void* ret=std::malloc(size?size:1))
+        return ret;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size,std::align_val_t alignment){
+    if(c3d::allocationForbidden())
+        std::fprintf(stderr,"c3d: heap allocation of %zu bytes aligned to %zu where allocation is forbidden\n",size,static_cast<std::size_t>(alignment)),std::abort();
+    const auto align=static_cast<std::size_t>(alignment);
+    if(void* ret=std::aligned_alloc(align,((size?size:1)+align-1)/align*align))
+        return ret;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size){return operator new(size);}
+void* operator new[](std::size_t size,std::align_val_t alignment){return operator new(size,alignment);}
+//The nothrow forms check through the throwing ones, as the default library versions do.
+void* operator new(std::size_t size,const std::nothrow_t&)noexcept{
+    try{
+        return operator new(size);
+    }catch(const std::bad_alloc&){
+        return nullptr;
+    }
+}
+void* operator new[](std::size_t size,const std::nothrow_t&)noexcept{return operator new(size,std::nothrow);}
+void* operator new(std::size_t size,std::align_val_t alignment,const std::nothrow_t&)noexcept{
+    try{
+        return operator new(size,alignment);
+    }catch(const std::bad_alloc&){
+        return nullptr;
+    }
 }
-#endif
\ No newline at end of file
+void* operator new[](std::size_t size,std::align_val_t alignment,const std::nothrow_t&)noexcept{return operator new(size,alignment,std::nothrow);}
+//Not inlined, so that the compiler does not see free() meet a pointer from operator new.
+[[gnu::noinline]] void operator delete(void* p)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete[](void* p)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete(void* p,std::size_t)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete[](void* p,std::size_t)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete(void* p,std::align_val_t)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete[](void* p,std::align_val_t)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete(void* p,std::size_t,std::align_val_t)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete[](void* p,std::size_t,std::align_val_t)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete(void* p,const std::nothrow_t&)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete[](void* p,const std::nothrow_t&)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete(void* p,std::align_val_t,const std::nothrow_t&)noexcept{std::free(p);}
+[[gnu::noinline]] void operator delete[](void* p,std::align_val_t,const std::nothrow_t&)noexcept{std::free(p);}
+#endif
+#endif
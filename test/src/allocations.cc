@@ -0,0 +1,67 @@
+#define C3D_CHECK_ALLOCATIONS
+#include<c3d.h>
+#include<csignal>
+#include<cstdio>
+#include<sys/wait.h>
+#include<unistd.h>
+//Every integrator has to render the passes after the first without heap allocation, which operator new checks and aborts on.
+struct alignas(64) Line{
+    double values[8];
+};
+void* volatile sink;
+int main(){
+    using namespace c3d;
+    const auto diffuse=std::make_shared<Diffuse>();
+    const auto mirror=std::make_shared<Mirror>();
+    std::vector<std::shared_ptr<const Hittable>> objects;
+    const auto add=[&](const Vector& center,const double& radius,std::shared_ptr<Material> material,std::shared_ptr<Light> light=nullptr){
+        auto sphere=std::make_shared<Sphere>();
+        sphere->center=center,sphere->radius=radius,sphere->material=std::move(material),sphere->light=std::move(light);
+        objects.push_back(std::move(sphere));
+    };
+    add({0,-1000,0},1000,diffuse);
+    add({-2.2,1,0},1,diffuse);
+    add({0,1,0.5},1,mirror);
+    add({2.2,1,0},1,diffuse);
+    add({-3,5,-2},0.8,nullptr,std::make_shared<Light>(Light{{1,0.9,0.8},20}));
+    add({3,4,-3},0.4,nullptr,std::make_shared<Light>(Light{{0.6,0.7,1},40}));
+    const BvhTree scene(objects);
+    const Camera camera{{0,2,-8},{0,-0.15,1},{0,1,0},PI/3,96,64};
+    auto path=std::make_unique<PathTracer>();
+    path->lights=std::make_shared<LightTree>(Emitters(objects));
+    auto wavefront=std::make_unique<WavefrontPathTracer>();
+    wavefront->sorting=true;
+    std::vector<std::pair<const char*,std::unique_ptr<Integrator>>> integrators;
+    integrators.emplace_back("path",std::move(path));
+    integrators.emplace_back("wavefront",std::move(wavefront));
+    integrators.emplace_back("bidirectional",std::make_unique<BidirectionalPathTracer>(Emitters(objects)));
+    integrators.emplace_back("photon",std::make_unique<PhotonMapper>(Emitters(objects)));
+    integrators.emplace_back("guided",std::make_unique<GuidedPathTracer>());
+    for(const auto& [name,integrator]:integrators){
+        RenderOptions options;
+        options.passes=4,options.threads=4,options.splatting=SplatMode::atomic;
+        Framebuffer framebuffer(camera.width,camera.height);
+        Renderer(options).render(scene,camera,*integrator,framebuffer);
+        std::printf("%s: no allocation after warm-up\n",name);
+    }
+    //Each form of operator new has to abort where allocation is forbidden, which a child process tries.
+    const auto aborts=[](void*(*allocate)()){
+        const pid_t child=fork();
+        if(!child){
+            const AllocationScope scope(true);
+            sink=allocate();
+            std::_Exit(0);
+        }
+        int status=0;
+        return waitpid(child,&status,0)==child&&WIFSIGNALED(status)&&WTERMSIG(status)==SIGABRT;
+    };
+    const std::pair<const char*,void*(*)()> forms[]={{"new",[]()->void*{return new int;}},
+                                                     {"aligned new",[]()->void*{return new Line;}},
+                                                     {"nothrow new[]",[]()->void*{return new(std::nothrow) int[4];}}};
+    for(const auto& [name,allocate]:forms){
+        if(!aborts(allocate))
+            return std::printf("%s: forbidden allocation not caught\n",name),1;
+        std::printf("%s: forbidden allocation caught\n",name);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include<c3d.h>
+#include<cstdio>
+//Every builder has to find the same closest hits as testing all objects, including on a geometric distribution that makes clustered trees deep,
+//before and after a refit.
+int main(){
+    using namespace c3d;
+    std::vector<std::shared_ptr<const Hittable>> spheres;
+    for(int i=0;i<1500;++i){
+        auto sphere=std::make_shared<Sphere>();
+        const double x=std::pow(1.2,i);
+        sphere->center={x,0,0},sphere->radius=1e-4*x;
+        spheres.push_back(std::move(sphere));
+    }
+    Generator generator(1);
+    std::uniform_real_distribution<> d(-1,1);
+    std::vector<std::pair<Vector,Vector>> rays{{{0,0,0},{1,0,0}}};
+    for(int i=0;i<1000;++i)
+        rays.push_back({{d(generator),d(generator),d(generator)},unit(Vector{1,d(generator)*1e-3,d(generator)*1e-3})});
+    int failures=0;
+    for(const BvhBuilder builder:{BvhBuilder::median,BvhBuilder::lbvh,BvhBuilder::ploc})
+        for(const bool compact:{false,true}){
+            BvhOptions options;
+            options.builder=builder,options.leafSize=1,options.compact=compact;
+            BvhTree tree(spheres,options);
+            for(std::size_t i=0;i<2*rays.size();++i){
+                if(i==rays.size())
+                    tree.refit();
+                const auto& [origin,direction]=rays[i%rays.size()];
+                //Compared by object, since the tree may intersect with FMA in a kernel dispatched for the CPU and round distances differently.
+                double closest=INF;
+                const Hittable* object=nullptr;
+                for(const auto& sphere:spheres)
+                    if(const auto record=sphere->hit(origin,direction,{0,closest}))
+                        closest=record->dist,object=sphere.get();
+                const auto record=tree.hit(origin,direction,{0,INF});
+                if((record?record->object:nullptr)!=object){
+                    std::fprintf(stderr,"builder %d, compact %d, height %u, refitted %d: mismatch\n",static_cast<int>(builder),compact,tree.height,i>=rays.size());
+                    ++failures;
+                    break;
+                }
+            }
+        }
+    return failures?1:0;
+}
@@ -0,0 +1,28 @@
+#include<c3d.h>
+#include<cstdio>
+//The coarsest mip level of a texture has to be the mean of the image, also for sizes that are not powers of two.
+int main(){
+    using namespace c3d;
+    const auto file=std::filesystem::temp_directory_path()/"c3d-test-mipmap.tex";
+    int failures=0;
+    for(const auto& [width,height]:{std::pair{1u,3u},{3u,1u},{1u,5u},{7u,200u},{5u,3u},{256u,256u}}){
+        std::vector<Color> pixels(std::size_t(width)*height);
+        Color mean{0,0,0};
+        for(std::uint32_t y=0;y<height;++y)
+            for(std::uint32_t x=0;x<width;++x){
+                const double v=height>1?static_cast<double>(y)/(height-1):0,u=width>1?static_cast<double>(x)/(width-1):0;
+                mean+=pixels[std::size_t(y)*width+x]=Color{v,u*u,u*v};
+            }
+        mean/=static_cast<double>(pixels.size());
+        const auto cache=std::make_shared<TextureCache>();
+        const auto texture=TiledTexture::write(file,width,height,pixels,4)?TiledTexture::open(file,cache):nullptr;
+        //A footprint covering the whole texture reads the coarsest level, which is 1*1.
+        const Color top=texture?texture->color(0.3,0.7,1):Color{-1,-1,-1};
+        if(norm(top-mean)>1e-6){
+            std::fprintf(stderr,"%u*%u: coarsest level (%g %g %g), mean (%g %g %g)\n",width,height,top.x,top.y,top.z,mean.x,mean.y,mean.z);
+            ++failures;
+        }
+    }
+    std::filesystem::remove(file);
+    return failures?1:0;
+}
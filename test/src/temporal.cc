@@ -0,0 +1,45 @@
+#include<c3d.h>
+#include<cstdio>
+//Filtering frames of a static camera rendered with different seeds has to converge towards the reference image.
+int main(){
+    using namespace c3d;
+    const auto diffuse=std::make_shared<Diffuse>();
+    std::vector<std::shared_ptr<const Hittable>> objects;
+    const auto add=[&](const Vector& center,const double& radius,std::shared_ptr<Material> material,std::shared_ptr<Light> light=nullptr){
+        auto sphere=std::make_shared<Sphere>();
+        sphere->center=center,sphere->radius=radius,sphere->material=std::move(material),sphere->light=std::move(light);
+        objects.push_back(std::move(sphere));
+    };
+    add({0,-1000,0},1000,diffuse);
+    add({0,1,0},1,diffuse);
+    add({-2,4,-2},1,nullptr,std::make_shared<Light>(Light{{1,1,1},4}));
+    const BvhTree scene(objects);
+    const Camera camera{{0,2,-6},{0,-0.2,1},{0,1,0},PI/3,48,32};
+    PathTracer integrator;
+    integrator.background={0.2,0.2,0.2};
+    integrator.lights=std::make_shared<LightTree>(Emitters(objects));
+    RenderOptions options;
+    options.passes=256;
+    Framebuffer reference(camera.width,camera.height);
+    Renderer(options).render(scene,camera,integrator,reference);
+    TemporalFilter filter;
+    const auto error=[&](const Framebuffer& frame){
+        double sum=0;
+        for(std::size_t y=0;y<camera.height;++y)
+            for(std::size_t x=0;x<camera.width;++x)
+                sum+=std::abs(luminance(frame.pixel(x,y))-luminance(reference.pixel(x,y)));
+        return sum/static_cast<double>(camera.width*camera.height);
+    };
+    options.passes=1;
+    double first=0,last=0;
+    for(std::uint64_t i=0;i<16;++i){
+        options.seed=i+1;
+        Framebuffer frame(camera.width,camera.height);
+        Renderer(options).render(scene,camera,integrator,frame);
+        last=error(filter.filter(scene,camera,frame));
+        if(!i)
+            first=last;
+    }
+    std::printf("mean error %.4f on the first frame, %.4f on the last\n",first,last);
+    return last<first*0.5?0:1;
+}